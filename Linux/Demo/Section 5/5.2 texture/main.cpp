@@ -4,6 +4,18 @@
 #include <cstring>
 #include <cstdint>
 #include <cmath>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <immintrin.h>
+#include "../../../OpenGL App/thread_pool.h"
 
 float vertex_buffer[4][6] = {
     {-0.5, -0.5, 0.0, 1.0, 0.0, 0.0},
@@ -24,6 +36,1334 @@ uint32_t shader_program_object;
 
 uint32_t texture_object;
 
+/* 解码时允许的最大宽度与高度，与常见实现的 GL_MAX_TEXTURE_SIZE 相同，避免损坏的文件头导致巨大的内存分配 */
+const uint32_t MAX_IMAGE_SIZE = 16384;
+
+/* 解码后的图像，像素为 RGBA8，第 0 行是图像的最下一行，与 GL 纹理坐标的方向一致 */
+struct Image
+{
+    int width, height;
+    std::vector<uint8_t> pixels;
+};
+
+bool ReadFileBytes(const char* path, std::vector<uint8_t>& bytes)
+{
+    FILE* file = nullptr;
+#ifdef _WIN32
+    fopen_s(&file, path, "rb");
+#else
+    file = fopen(path, "rb");
+#endif
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    int64_t length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    bytes.resize(length);
+    bool ok = fread(bytes.data(), 1, length, file) == (size_t)length;
+    fclose(file);
+    return ok;
+}
+
+uint32_t ReadLE16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+uint32_t ReadLE32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+uint32_t ReadBE32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+/* 未压缩的 24 位与 32 位 BMP，行按 4 字节对齐，高度为负时按从上到下存储 */
+bool DecodeBMP(const std::vector<uint8_t>& file, Image& image)
+{
+    if (file.size() < 54 || file[0] != 'B' || file[1] != 'M') return false;
+    uint32_t offset = ReadLE32(&file[10]);
+    uint32_t header_size = ReadLE32(&file[14]);
+    int32_t width = (int32_t)ReadLE32(&file[18]);
+    int32_t height = (int32_t)ReadLE32(&file[22]);
+    uint32_t bits = ReadLE16(&file[28]);
+    uint32_t compression = ReadLE32(&file[30]);
+    /* compression 为 3 (BI_BITFIELDS) 时假定为 BGRA 的掩码 */
+    if (header_size < 40 || width <= 0 || height == 0 || (bits != 24 && bits != 32) ||
+        !(compression == 0 || (compression == 3 && bits == 32))) return false;
+    bool top_down = height < 0;
+    height = std::abs(height);
+    uint32_t bytes_per_pixel = bits / 8;
+    uint64_t stride = ((uint64_t)width * bytes_per_pixel + 3) & ~(uint64_t)3;
+    if (offset + stride * height > file.size()) return false;
+
+    image.width = width;
+    image.height = height;
+    image.pixels.resize((size_t)width * height * 4);
+    for (int32_t y = 0; y < height; y++)
+    {
+        const uint8_t* src = &file[offset + stride * (top_down ? height - 1 - y : y)];
+        uint8_t* dst = &image.pixels[(size_t)y * width * 4];
+        for (int32_t x = 0; x < width; x++, src += bytes_per_pixel, dst += 4)
+        {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+            dst[3] = compression == 3 ? src[3] : 255;
+        }
+    }
+    return true;
+}
+
+/* 从低位开始读取的位流，deflate 的各个字段都按这个顺序存储 */
+struct BitReader
+{
+    const uint8_t* data;
+    size_t size, pos;
+    uint64_t bits;
+    int count;
+
+    /* 超出数据末尾的部分补 0，由 Overrun 检查 */
+    void Refill()
+    {
+        while (count <= 56)
+        {
+            bits |= (uint64_t)(pos < size ? data[pos] : 0) << count;
+            pos++;
+            count += 8;
+        }
+    }
+    uint32_t Peek(int n) const { return (uint32_t)(bits & ((1ull << n) - 1)); }
+    void Skip(int n) { bits >>= n; count -= n; }
+    uint32_t Read(int n)
+    {
+        if (count < n) Refill();
+        uint32_t value = Peek(n);
+        Skip(n);
+        return value;
+    }
+    bool Overrun() const { return pos - count / 8 > size; }
+};
+
+/* 范式 Huffman 码的查找表，以 max_length 位的(位反转后的)码为下标，每项为 (符号 << 4) | 码长 */
+struct HuffmanTable
+{
+    std::vector<uint16_t> entries;
+    int max_length;
+
+    bool Build(const uint8_t* lengths, int count)
+    {
+        int length_count[16] = {};
+        for (int i = 0; i < count; i++) length_count[lengths[i]]++;
+        length_count[0] = 0;
+        max_length = 1;
+        int left = 1;
+        for (int l = 1; l < 16; l++)
+        {
+            if (length_count[l]) max_length = l;
+            left = (left << 1) - length_count[l];
+            if (left < 0) return false;
+        }
+        int next_code[16];
+        int code = 0;
+        for (int l = 1; l < 16; l++)
+        {
+            code = (code + length_count[l - 1]) << 1;
+            next_code[l] = code;
+        }
+        /* 未使用的码对应的项为 0，解码时视为错误 */
+        entries.assign((size_t)1 << max_length, 0);
+        for (int symbol = 0; symbol < count; symbol++)
+        {
+            int l = lengths[symbol];
+            if (!l) continue;
+            int c = next_code[l]++, reversed = 0;
+            for (int i = 0; i < l; i++) reversed |= ((c >> i) & 1) << (l - 1 - i);
+            for (int i = reversed; i < (1 << max_length); i += 1 << l)
+                entries[i] = (uint16_t)((symbol << 4) | l);
+        }
+        return true;
+    }
+
+    int Decode(BitReader& reader) const
+    {
+        if (reader.count < max_length) reader.Refill();
+        uint16_t entry = entries[reader.Peek(max_length)];
+        if (!(entry & 15)) return -1;
+        reader.Skip(entry & 15);
+        return entry >> 4;
+    }
+};
+
+/*
+    解压 deflate 数据 (RFC 1951)，解压结果追加到 out。out 的大小超过 max_size 时失败，
+    数据被截断时 BitReader 读到的是补上的 0，可能一直解出字面量，因此每个符号之后都检查是否越界。
+*/
+bool Inflate(const uint8_t* data, size_t size, std::vector<uint8_t>& out, size_t max_size)
+{
+    static const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const uint8_t DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    static const uint8_t CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    BitReader reader = { data, size, 0, 0, 0 };
+    HuffmanTable literal_table, distance_table;
+    bool last = false;
+    while (!last)
+    {
+        last = reader.Read(1) != 0;
+        uint32_t type = reader.Read(2);
+        if (type == 0)
+        {
+            /* 不压缩的块：跳到字节边界后是长度及其反码 */
+            reader.Skip(reader.count & 7);
+            uint32_t length = reader.Read(16);
+            if ((length ^ 0xFFFF) != reader.Read(16) || length > max_size - out.size()) return false;
+            for (uint32_t i = 0; i < length; i++) out.push_back((uint8_t)reader.Read(8));
+            if (reader.Overrun()) return false;
+            continue;
+        }
+        uint8_t lengths[288 + 32];
+        if (type == 1)
+        {
+            /* 固定 Huffman 码 */
+            for (int i = 0; i < 288; i++) lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+            for (int i = 0; i < 30; i++) lengths[288 + i] = 5;
+            literal_table.Build(lengths, 288);
+            distance_table.Build(lengths + 288, 30);
+        }
+        else if (type == 2)
+        {
+            /* 动态 Huffman 码：码长本身也经过 Huffman 编码与游程编码 */
+            int literal_count = reader.Read(5) + 257;
+            int distance_count = reader.Read(5) + 1;
+            int code_length_count = reader.Read(4) + 4;
+            uint8_t code_lengths[19] = {};
+            for (int i = 0; i < code_length_count; i++) code_lengths[CODE_LENGTH_ORDER[i]] = (uint8_t)reader.Read(3);
+            HuffmanTable code_length_table;
+            if (!code_length_table.Build(code_lengths, 19)) return false;
+            int total = literal_count + distance_count, n = 0;
+            while (n < total)
+            {
+                int symbol = code_length_table.Decode(reader);
+                if (symbol < 0) return false;
+                if (symbol < 16)
+                {
+                    lengths[n++] = (uint8_t)symbol;
+                    continue;
+                }
+                int repeat, value = 0;
+                if (symbol == 16)
+                {
+                    if (!n) return false;
+                    value = lengths[n - 1];
+                    repeat = 3 + reader.Read(2);
+                }
+                else if (symbol == 17) repeat = 3 + reader.Read(3);
+                else repeat = 11 + reader.Read(7);
+                if (n + repeat > total) return false;
+                while (repeat--) lengths[n++] = (uint8_t)value;
+            }
+            if (!literal_table.Build(lengths, literal_count) || !distance_table.Build(lengths + literal_count, distance_count)) return false;
+        }
+        else return false;
+
+        for (;;)
+        {
+            int symbol = literal_table.Decode(reader);
+            if (symbol < 0 || reader.Overrun()) return false;
+            if (symbol < 256)
+            {
+                if (out.size() == max_size) return false;
+                out.push_back((uint8_t)symbol);
+                continue;
+            }
+            if (symbol == 256) break;
+            symbol -= 257;
+            if (symbol >= 29) return false;
+            uint32_t length = LENGTH_BASE[symbol] + reader.Read(LENGTH_EXTRA[symbol]);
+            int distance_symbol = distance_table.Decode(reader);
+            if (distance_symbol < 0 || distance_symbol >= 30) return false;
+            uint32_t distance = DISTANCE_BASE[distance_symbol] + reader.Read(DISTANCE_EXTRA[distance_symbol]);
+            if (distance > out.size() || length > max_size - out.size()) return false;
+            size_t from = out.size() - distance;
+            for (uint32_t i = 0; i < length; i++) out.push_back(out[from + i]);
+            if (reader.Overrun()) return false;
+        }
+    }
+    return true;
+}
+
+uint8_t PaethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return (uint8_t)a;
+    return (uint8_t)(pb <= pc ? b : c);
+}
+
+/* 8 位深度、非隔行扫描的 PNG，支持灰度、RGB、调色板、灰度 + alpha 与 RGBA */
+bool DecodePNG(const std::vector<uint8_t>& file, Image& image)
+{
+    static const uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (file.size() < 8 || memcmp(file.data(), SIGNATURE, 8)) return false;
+
+    uint32_t width = 0, height = 0;
+    int bit_depth = 0, color_type = 0, interlace = 0;
+    uint8_t palette[256][4];
+    for (int i = 0; i < 256; i++) palette[i][0] = palette[i][1] = palette[i][2] = 0, palette[i][3] = 255;
+    std::vector<uint8_t> compressed;
+    size_t pos = 8;
+    while (pos + 12 <= file.size())
+    {
+        uint32_t length = ReadBE32(&file[pos]);
+        const uint8_t* type = &file[pos + 4];
+        const uint8_t* chunk = &file[pos + 8];
+        if (length > file.size() - pos - 12) return false;
+        if (!memcmp(type, "IHDR", 4) && length >= 13)
+        {
+            width = ReadBE32(chunk);
+            height = ReadBE32(chunk + 4);
+            bit_depth = chunk[8];
+            color_type = chunk[9];
+            interlace = chunk[12];
+        }
+        else if (!memcmp(type, "PLTE", 4))
+        {
+            for (uint32_t i = 0; i < length / 3 && i < 256; i++)
+                memcpy(palette[i], chunk + i * 3, 3);
+        }
+        else if (!memcmp(type, "tRNS", 4) && color_type == 3)
+        {
+            for (uint32_t i = 0; i < length && i < 256; i++) palette[i][3] = chunk[i];
+        }
+        else if (!memcmp(type, "IDAT", 4))
+            compressed.insert(compressed.end(), chunk, chunk + length);
+        else if (!memcmp(type, "IEND", 4))
+            break;
+        pos += 12 + length;
+    }
+
+    static const int CHANNELS[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    if (!width || !height || width > MAX_IMAGE_SIZE || height > MAX_IMAGE_SIZE || bit_depth != 8 || interlace != 0 || color_type > 6 || !CHANNELS[color_type]) return false;
+    /* zlib 头：压缩方法为 deflate，不使用预设字典，末尾的 Adler-32 校验不检查 */
+    if (compressed.size() < 2 || (compressed[0] & 0x0F) != 8 || (compressed[1] & 0x20)) return false;
+
+    uint32_t channels = CHANNELS[color_type];
+    size_t stride = (size_t)width * channels;
+    size_t raw_size = (stride + 1) * height;
+    std::vector<uint8_t> raw;
+    raw.reserve(raw_size);
+    if (!Inflate(compressed.data() + 2, compressed.size() - 2, raw, raw_size) || raw.size() < raw_size) return false;
+
+    /* 逐行还原滤波，每行开头的一个字节为滤波方式 */
+    image.width = width;
+    image.height = height;
+    image.pixels.resize((size_t)width * height * 4);
+    std::vector<uint8_t> previous(stride, 0);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint8_t filter = raw[y * (stride + 1)];
+        uint8_t* row = &raw[y * (stride + 1) + 1];
+        for (size_t i = 0; i < stride; i++)
+        {
+            int a = i >= channels ? row[i - channels] : 0;
+            int b = previous[i];
+            int c = i >= channels ? previous[i - channels] : 0;
+            switch (filter)
+            {
+            case 0: break;
+            case 1: row[i] += a; break;
+            case 2: row[i] += b; break;
+            case 3: row[i] += (a + b) / 2; break;
+            case 4: row[i] += PaethPredictor(a, b, c); break;
+            default: return false;
+            }
+        }
+        memcpy(previous.data(), row, stride);
+
+        uint8_t* dst = &image.pixels[(size_t)(height - 1 - y) * width * 4];
+        for (uint32_t x = 0; x < width; x++, dst += 4)
+        {
+            const uint8_t* src = row + x * channels;
+            switch (color_type)
+            {
+            case 0: dst[0] = dst[1] = dst[2] = src[0]; dst[3] = 255; break;
+            case 2: dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = 255; break;
+            case 3: memcpy(dst, palette[src[0]], 4); break;
+            case 4: dst[0] = dst[1] = dst[2] = src[0]; dst[3] = src[1]; break;
+            case 6: memcpy(dst, src, 4); break;
+            }
+        }
+    }
+    return true;
+}
+
+/* 按文件头判断格式 */
+bool DecodeImage(const std::vector<uint8_t>& file, Image& image)
+{
+    return DecodePNG(file, image) || DecodeBMP(file, image);
+}
+
+ThreadPool thread_pool;
+
+/*
+    sRGB 编码的颜色在线性空间中平均才是正确的亮度。解码用 256 项的表，
+    编码把线性值量化到 LINEAR_TO_SRGB_BITS 位再查表，最暗处的量化误差也小于半个 sRGB 级。
+*/
+const int LINEAR_TO_SRGB_BITS = 14;
+float srgb_to_linear[256];
+uint8_t linear_to_srgb[1 << LINEAR_TO_SRGB_BITS];
+
+void InitColorTables()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        float c = i / 255.0f;
+        srgb_to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+    for (int i = 0; i < (1 << LINEAR_TO_SRGB_BITS); i++)
+    {
+        float l = i / (float)((1 << LINEAR_TO_SRGB_BITS) - 1);
+        float c = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+        linear_to_srgb[i] = (uint8_t)lroundf(c * 255.0f);
+    }
+}
+
+/* 把一行 RGBA8 转为线性的浮点数，alpha 本身就是线性的 */
+void DecodeRowToLinear(const uint8_t* src, int width, float* dst)
+{
+    for (int x = 0; x < width * 4; x += 4)
+    {
+        dst[x + 0] = srgb_to_linear[src[x + 0]];
+        dst[x + 1] = srgb_to_linear[src[x + 1]];
+        dst[x + 2] = srgb_to_linear[src[x + 2]];
+        dst[x + 3] = src[x + 3] * (1.0f / 255.0f);
+    }
+}
+
+/* 一个方向上目标像素对应的三个源像素及其权重 */
+struct DownsampleTaps
+{
+    int index[3];
+    float weight[3];
+};
+
+/*
+    源尺寸为偶数(或为 1)时每个目标像素取两个源像素的平均；为奇数 n 时目标尺寸 m = n / 2，
+    每个目标像素 i 覆盖 n / m 个源像素，取 2i、2i+1、2i+2 三个，权重为 (m - i) / n、m / n、(i + 1) / n，
+    最后一列/行也计入结果，整幅图的平均亮度不变。
+*/
+void ComputeDownsampleTaps(int src_size, int dst_size, std::vector<DownsampleTaps>& taps)
+{
+    taps.resize(dst_size);
+    for (int i = 0; i < dst_size; i++)
+    {
+        DownsampleTaps& tap = taps[i];
+        if (src_size % 2 == 0 || src_size == 1)
+        {
+            tap.index[0] = std::min(2 * i, src_size - 1);
+            tap.index[1] = tap.index[2] = std::min(2 * i + 1, src_size - 1);
+            tap.weight[0] = tap.weight[1] = 0.5f;
+            tap.weight[2] = 0.0f;
+        }
+        else
+        {
+            tap.index[0] = 2 * i;
+            tap.index[1] = 2 * i + 1;
+            tap.index[2] = 2 * i + 2;
+            tap.weight[0] = (float)(dst_size - i) / src_size;
+            tap.weight[1] = (float)dst_size / src_size;
+            tap.weight[2] = (float)(i + 1) / src_size;
+        }
+    }
+}
+
+/*
+    由 src 生成下一级 mipmap 中 [y_begin, y_end) 行：盒式滤波，在线性空间中平均，权重见 ComputeDownsampleTaps。
+    先把所需的源行按权重合并为一行，再在水平方向上滤波。每个像素的四个通道放在一个 SSE 寄存器中一起计算。
+*/
+void DownsampleRows(const Image& src, Image& dst, int y_begin, int y_end)
+{
+    std::vector<DownsampleTaps> taps_x, taps_y;
+    ComputeDownsampleTaps(src.width, dst.width, taps_x);
+    ComputeDownsampleTaps(src.height, dst.height, taps_y);
+    std::vector<float> rows(src.width * 4 * 4);
+    float* decoded = rows.data();
+    float* column = rows.data() + src.width * 4 * 3;
+    const __m128 scale = _mm_setr_ps((1 << LINEAR_TO_SRGB_BITS) - 1, (1 << LINEAR_TO_SRGB_BITS) - 1, (1 << LINEAR_TO_SRGB_BITS) - 1, 255.0f);
+    for (int y = y_begin; y < y_end; y++)
+    {
+        const DownsampleTaps& tap_y = taps_y[y];
+        int row_count = tap_y.weight[2] > 0.0f ? 3 : 2;
+        for (int r = 0; r < row_count; r++)
+            DecodeRowToLinear(&src.pixels[(size_t)tap_y.index[r] * src.width * 4], src.width, decoded + src.width * 4 * r);
+        for (int x = 0; x < src.width * 4; x += 4)
+        {
+            __m128 sum = _mm_mul_ps(_mm_loadu_ps(decoded + x), _mm_set1_ps(tap_y.weight[0]));
+            for (int r = 1; r < row_count; r++)
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(decoded + src.width * 4 * r + x), _mm_set1_ps(tap_y.weight[r])));
+            _mm_storeu_ps(column + x, sum);
+        }
+        uint8_t* out = &dst.pixels[(size_t)y * dst.width * 4];
+        for (int x = 0; x < dst.width; x++, out += 4)
+        {
+            const DownsampleTaps& tap_x = taps_x[x];
+            __m128 sum = _mm_add_ps(
+                _mm_add_ps(
+                    _mm_mul_ps(_mm_loadu_ps(column + tap_x.index[0] * 4), _mm_set1_ps(tap_x.weight[0])),
+                    _mm_mul_ps(_mm_loadu_ps(column + tap_x.index[1] * 4), _mm_set1_ps(tap_x.weight[1]))),
+                _mm_mul_ps(_mm_loadu_ps(column + tap_x.index[2] * 4), _mm_set1_ps(tap_x.weight[2])));
+            /* _mm_cvtps_epi32 按当前舍入方式(默认为最近)取整 */
+            alignas(16) int32_t index[4];
+            _mm_store_si128((__m128i*)index, _mm_cvtps_epi32(_mm_mul_ps(sum, scale)));
+            out[0] = linear_to_srgb[index[0]];
+            out[1] = linear_to_srgb[index[1]];
+            out[2] = linear_to_srgb[index[2]];
+            out[3] = (uint8_t)index[3];
+        }
+    }
+}
+
+/* levels[0] 为原图，依次生成到 1x1 为止的所有级别。每一级依赖上一级，级别内按行在线程池中并行 */
+void GenerateMipChain(std::vector<Image>& levels, bool parallel = true)
+{
+    levels.resize(1);
+    while (levels.back().width > 1 || levels.back().height > 1)
+    {
+        levels.push_back(Image());
+        const Image& src = levels[levels.size() - 2];
+        Image& dst = levels.back();
+        dst.width = std::max(1, src.width / 2);
+        dst.height = std::max(1, src.height / 2);
+        dst.pixels.resize((size_t)dst.width * dst.height * 4);
+        if (parallel)
+            thread_pool.ParallelFor(dst.height, 16, [&](uint32_t begin, uint32_t end) { DownsampleRows(src, dst, begin, end); });
+        else
+            DownsampleRows(src, dst, 0, dst.height);
+    }
+}
+
+/* 用程序生成的 4K 到 8K 的图像测量 mipmap 生成的吞吐量，分别测量单线程与线程池 */
+void RunMipBenchmark()
+{
+    const int SIZES[][2] = { { 4096, 4096 }, { 8192, 4096 }, { 8192, 8192 } };
+    for (size_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); i++)
+    {
+        std::vector<Image> levels(1);
+        levels[0].width = SIZES[i][0];
+        levels[0].height = SIZES[i][1];
+        levels[0].pixels.resize((size_t)SIZES[i][0] * SIZES[i][1] * 4);
+        uint32_t state = 2022;
+        for (size_t j = 0; j < levels[0].pixels.size(); j++)
+        {
+            state = state * 1664525u + 1013904223u;
+            levels[0].pixels[j] = (uint8_t)(state >> 24);
+        }
+        double source_mb = levels[0].pixels.size() / 1048576.0;
+        for (int parallel = 0; parallel < 2; parallel++)
+        {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            GenerateMipChain(levels, parallel != 0);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+            std::cout << "Mip chain " << SIZES[i][0] << "x" << SIZES[i][1] << " (" << levels.size() << " levels), "
+                << (parallel ? thread_pool.workers.size() + 1 : 1) << " threads: " << ms << "ms, "
+                << source_mb / (ms * 1e-3) << "MB/s" << std::endl;
+        }
+    }
+}
+
+/* GL 4.6 核心模式的加载器中没有 S3TC 扩展的常量 */
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#define GL_COMPRESSED_SRGB_S3TC_DXT1_EXT 0x8C4C
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+
+/*
+    纹理格式。8 位的图像直接使用 RGBA8 (每像素 4 字节)，不需要转换为浮点数。
+    BC1 每 4x4 块 8 字节(不透明)，BC3 与 BC7 每块 16 字节(带 alpha)，由离线编码器生成。
+    图像数据按 sRGB 编码保存，SRGB_TEXTURES 为 true 时使用 sRGB 内部格式，采样得到线性值，
+    同时开启 GL_FRAMEBUFFER_SRGB 在写入时转换回 sRGB。
+*/
+const bool SRGB_TEXTURES = true;
+
+enum TextureFormat
+{
+    TEXTURE_FORMAT_RGBA8, TEXTURE_FORMAT_BC1, TEXTURE_FORMAT_BC3, TEXTURE_FORMAT_BC7,
+    TEXTURE_FORMAT_COUNT
+};
+
+struct TextureFormatInfo
+{
+    const char* name;
+    uint32_t internal_format, srgb_internal_format;
+    /* 每个 4x4 块的字节数，0 表示不压缩 */
+    uint32_t block_bytes;
+};
+
+const TextureFormatInfo TEXTURE_FORMATS[TEXTURE_FORMAT_COUNT] = {
+    { "rgba8", GL_RGBA8, GL_SRGB8_ALPHA8, 0 },
+    { "bc1", GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_SRGB_S3TC_DXT1_EXT, 8 },
+    { "bc3", GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT, 16 },
+    { "bc7", GL_COMPRESSED_RGBA_BPTC_UNORM, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM, 16 },
+};
+
+uint32_t TextureInternalFormat(int format)
+{
+    return SRGB_TEXTURES ? TEXTURE_FORMATS[format].srgb_internal_format : TEXTURE_FORMATS[format].internal_format;
+}
+
+/* 一个级别在 GPU 中占用的字节数 */
+size_t TextureLevelBytes(int format, int width, int height)
+{
+    if (!TEXTURE_FORMATS[format].block_bytes) return (size_t)width * height * 4;
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * TEXTURE_FORMATS[format].block_bytes;
+}
+
+/* 读取图像中的一个 4x4 块，超出图像的部分重复边缘的像素 */
+void FetchBlock(const Image& image, int bx, int by, float block[16][4])
+{
+    for (int i = 0; i < 16; i++)
+    {
+        int x = std::min(bx * 4 + (i & 3), image.width - 1);
+        int y = std::min(by * 4 + (i >> 2), image.height - 1);
+        const uint8_t* p = &image.pixels[((size_t)y * image.width + x) * 4];
+        for (int c = 0; c < 4; c++) block[i][c] = p[c];
+    }
+}
+
+/* 块中颜色的均值与主轴(协方差矩阵最大特征值对应的特征向量，用幂迭代求得)，只使用前 channels 个通道 */
+void PrincipalAxis(const float block[16][4], int channels, float mean[4], float axis[4])
+{
+    for (int c = 0; c < 4; c++)
+    {
+        mean[c] = 0.0f;
+        for (int i = 0; i < 16; i++) mean[c] += block[i][c] / 16.0f;
+    }
+    float covariance[4][4] = {};
+    for (int i = 0; i < 16; i++)
+        for (int a = 0; a < channels; a++)
+            for (int b = 0; b < channels; b++)
+                covariance[a][b] += (block[i][a] - mean[a]) * (block[i][b] - mean[b]);
+    for (int c = 0; c < 4; c++) axis[c] = c < channels ? 1.0f : 0.0f;
+    for (int iteration = 0; iteration < 8; iteration++)
+    {
+        float next[4] = {}, norm = 0.0f;
+        for (int a = 0; a < channels; a++)
+        {
+            for (int b = 0; b < channels; b++) next[a] += covariance[a][b] * axis[b];
+            norm = std::max(norm, fabsf(next[a]));
+        }
+        if (norm < 1e-6f) break;
+        for (int a = 0; a < channels; a++) axis[a] = next[a] / norm;
+    }
+}
+
+/* 沿主轴取块中颜色投影的两端作为初始端点 */
+void FitEndpoints(const float block[16][4], int channels, float e0[4], float e1[4])
+{
+    float mean[4], axis[4];
+    PrincipalAxis(block, channels, mean, axis);
+    float t_min = 1e30f, t_max = -1e30f;
+    for (int i = 0; i < 16; i++)
+    {
+        float t = 0.0f;
+        for (int c = 0; c < channels; c++) t += (block[i][c] - mean[c]) * axis[c];
+        t_min = std::min(t_min, t);
+        t_max = std::max(t_max, t);
+    }
+    for (int c = 0; c < 4; c++)
+    {
+        e0[c] = std::min(255.0f, std::max(0.0f, mean[c] + axis[c] * t_max));
+        e1[c] = std::min(255.0f, std::max(0.0f, mean[c] + axis[c] * t_min));
+    }
+}
+
+/*
+    已知每个像素在两个端点之间的权重 w (颜色为 (1 - w) * e0 + w * e1) 时，
+    用最小二乘求使误差最小的端点。权重全部相同时方程退化，保持原来的端点。
+*/
+void RefineEndpoints(const float block[16][4], const float weights[16], int channels, float e0[4], float e1[4])
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[4] = {}, bx[4] = {};
+    for (int i = 0; i < 16; i++)
+    {
+        float a = 1.0f - weights[i], b = weights[i];
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < channels; c++)
+        {
+            ax[c] += a * block[i][c];
+            bx[c] += b * block[i][c];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if (fabsf(det) < 1e-6f) return;
+    for (int c = 0; c < channels; c++)
+    {
+        e0[c] = std::min(255.0f, std::max(0.0f, (ax[c] * bb - bx[c] * ab) / det));
+        e1[c] = std::min(255.0f, std::max(0.0f, (bx[c] * aa - ax[c] * ab) / det));
+    }
+}
+
+uint16_t PackRGB565(const float color[4])
+{
+    int r = (int)lroundf(color[0] * 31.0f / 255.0f);
+    int g = (int)lroundf(color[1] * 63.0f / 255.0f);
+    int b = (int)lroundf(color[2] * 31.0f / 255.0f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+void UnpackRGB565(uint16_t packed, float color[4])
+{
+    int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+    color[0] = (float)((r << 3) | (r >> 2));
+    color[1] = (float)((g << 2) | (g >> 4));
+    color[2] = (float)((b << 3) | (b >> 2));
+    color[3] = 255.0f;
+}
+
+/*
+    由一对 565 端点编码 BC1 的颜色部分：总是使用四色模式(c0 > c1)，BC3 的颜色部分也要求这种模式。
+    返回块的平方误差。
+*/
+float EncodeColorEndpoints(const float block[16][4], uint16_t c0, uint16_t c1, uint8_t* out, float weights[16])
+{
+    static const float PALETTE_WEIGHTS[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+    if (c0 < c1) std::swap(c0, c1);
+    float palette[4][4];
+    UnpackRGB565(c0, palette[0]);
+    UnpackRGB565(c1, palette[1]);
+    for (int c = 0; c < 3; c++)
+    {
+        palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+        palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+    uint32_t indices = 0;
+    float error = 0.0f;
+    for (int i = 0; i < 16; i++)
+    {
+        int best = 0;
+        float best_error = 1e30f;
+        for (int k = 0; k < (c0 == c1 ? 1 : 4); k++)
+        {
+            float e = 0.0f;
+            for (int c = 0; c < 3; c++) e += (block[i][c] - palette[k][c]) * (block[i][c] - palette[k][c]);
+            if (e < best_error)
+            {
+                best_error = e;
+                best = k;
+            }
+        }
+        indices |= (uint32_t)best << (2 * i);
+        weights[i] = PALETTE_WEIGHTS[best];
+        error += best_error;
+    }
+    out[0] = c0 & 255;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 255;
+    out[3] = c1 >> 8;
+    memcpy(out + 4, &indices, 4);
+    return error;
+}
+
+/* BC1 的颜色块(8 字节)：主轴端点，再用最小二乘修正一次，保留误差较小的结果 */
+void EncodeBC1Block(const float block[16][4], uint8_t* out)
+{
+    float e0[4], e1[4], weights[16];
+    FitEndpoints(block, 3, e0, e1);
+    float error = EncodeColorEndpoints(block, PackRGB565(e0), PackRGB565(e1), out, weights);
+    /* EncodeColorEndpoints 可能交换了端点，权重对应写入的 c0 与 c1 */
+    UnpackRGB565(out[0] | (out[1] << 8), e0);
+    UnpackRGB565(out[2] | (out[3] << 8), e1);
+    RefineEndpoints(block, weights, 3, e0, e1);
+    uint8_t refined[8];
+    if (EncodeColorEndpoints(block, PackRGB565(e0), PackRGB565(e1), refined, weights) < error)
+        memcpy(out, refined, 8);
+}
+
+/* BC3 的 alpha 块(8 字节)：端点取最大值与最小值，使用 8 级插值模式 */
+void EncodeBC3AlphaBlock(const float block[16][4], uint8_t* out)
+{
+    float a_min = 255.0f, a_max = 0.0f;
+    for (int i = 0; i < 16; i++)
+    {
+        a_min = std::min(a_min, block[i][3]);
+        a_max = std::max(a_max, block[i][3]);
+    }
+    uint8_t a0 = (uint8_t)lroundf(a_max), a1 = (uint8_t)lroundf(a_min);
+    out[0] = a0;
+    out[1] = a1;
+    uint64_t indices = 0;
+    if (a0 > a1)
+        for (int i = 0; i < 16; i++)
+        {
+            /* 第 step 级(0 为 a1，7 为 a0)对应的索引：0 为 a0，1 为 a1，2 到 7 为由 a0 向 a1 的插值 */
+            int step = (int)lroundf((block[i][3] - a1) * 7.0f / (a0 - a1));
+            uint64_t index = step == 7 ? 0 : step == 0 ? 1 : 8 - step;
+            indices |= index << (3 * i);
+        }
+    for (int i = 0; i < 6; i++) out[2 + i] = (uint8_t)(indices >> (8 * i));
+}
+
+/* 从低位开始把 count 位写入 128 位的块 */
+void PutBits(uint8_t* out, int& position, uint32_t value, int count)
+{
+    for (int i = 0; i < count; i++, position++)
+        if ((value >> i) & 1) out[position >> 3] |= 1 << (position & 7);
+}
+
+/*
+    BC7 只使用模式 6：一个子集，RGBA 端点各 7 位加每个端点一个 p 位，4 位索引。
+    端点取 RGBA 主轴的两端并用最小二乘修正，四种 p 位组合中保留误差最小的一种。
+*/
+float EncodeBC7Mode6(const float block[16][4], const float e0[4], const float e1[4], uint8_t* out, float weights[16])
+{
+    static const int WEIGHTS[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+    float best_error = 1e30f;
+    int best_q[2][4] = {}, best_p[2] = {}, best_indices[16] = {};
+    for (int pbits = 0; pbits < 4; pbits++)
+    {
+        int p[2] = { pbits & 1, pbits >> 1 }, q[2][4], endpoint[2][4];
+        for (int c = 0; c < 4; c++)
+        {
+            q[0][c] = std::min(127, std::max(0, (int)lroundf((e0[c] - p[0]) / 2.0f)));
+            q[1][c] = std::min(127, std::max(0, (int)lroundf((e1[c] - p[1]) / 2.0f)));
+            endpoint[0][c] = (q[0][c] << 1) | p[0];
+            endpoint[1][c] = (q[1][c] << 1) | p[1];
+        }
+        int palette[16][4];
+        for (int k = 0; k < 16; k++)
+            for (int c = 0; c < 4; c++)
+                palette[k][c] = ((64 - WEIGHTS[k]) * endpoint[0][c] + WEIGHTS[k] * endpoint[1][c] + 32) >> 6;
+        float error = 0.0f;
+        int indices[16];
+        for (int i = 0; i < 16; i++)
+        {
+            float pixel_error = 1e30f;
+            for (int k = 0; k < 16; k++)
+            {
+                float e = 0.0f;
+                for (int c = 0; c < 4; c++) e += (block[i][c] - palette[k][c]) * (block[i][c] - palette[k][c]);
+                if (e < pixel_error)
+                {
+                    pixel_error = e;
+                    indices[i] = k;
+                }
+            }
+            error += pixel_error;
+        }
+        if (error < best_error)
+        {
+            best_error = error;
+            memcpy(best_q, q, sizeof(q));
+            memcpy(best_p, p, sizeof(p));
+            memcpy(best_indices, indices, sizeof(indices));
+        }
+    }
+    for (int i = 0; i < 16; i++) weights[i] = WEIGHTS[best_indices[i]] / 64.0f;
+
+    /* 第一个像素的索引最高位固定为 0，不满足时交换端点 */
+    if (best_indices[0] & 8)
+    {
+        for (int c = 0; c < 4; c++) std::swap(best_q[0][c], best_q[1][c]);
+        std::swap(best_p[0], best_p[1]);
+        for (int i = 0; i < 16; i++) best_indices[i] = 15 - best_indices[i];
+    }
+    memset(out, 0, 16);
+    int position = 0;
+    PutBits(out, position, 1 << 6, 7);
+    for (int c = 0; c < 4; c++)
+    {
+        PutBits(out, position, best_q[0][c], 7);
+        PutBits(out, position, best_q[1][c], 7);
+    }
+    PutBits(out, position, best_p[0], 1);
+    PutBits(out, position, best_p[1], 1);
+    for (int i = 0; i < 16; i++) PutBits(out, position, best_indices[i], i == 0 ? 3 : 4);
+    return best_error;
+}
+
+void EncodeBC7Block(const float block[16][4], uint8_t* out)
+{
+    float e0[4], e1[4], weights[16];
+    FitEndpoints(block, 4, e0, e1);
+    float error = EncodeBC7Mode6(block, e0, e1, out, weights);
+    /* 交换端点不影响权重与颜色的对应关系，这里的权重是相对于 e0 与 e1 的 */
+    RefineEndpoints(block, weights, 4, e0, e1);
+    uint8_t refined[16];
+    if (EncodeBC7Mode6(block, e0, e1, refined, weights) < error)
+        memcpy(out, refined, 16);
+}
+
+/* 压缩一个级别，按块行在线程池中并行 */
+void CompressLevel(const Image& image, int format, Image& compressed)
+{
+    int blocks_x = (image.width + 3) / 4, blocks_y = (image.height + 3) / 4;
+    uint32_t block_bytes = TEXTURE_FORMATS[format].block_bytes;
+    compressed.width = image.width;
+    compressed.height = image.height;
+    compressed.pixels.assign((size_t)blocks_x * blocks_y * block_bytes, 0);
+    thread_pool.ParallelFor(blocks_y, 4, [&](uint32_t begin, uint32_t end)
+    {
+        float block[16][4];
+        for (uint32_t by = begin; by < end; by++)
+            for (int bx = 0; bx < blocks_x; bx++)
+            {
+                uint8_t* out = &compressed.pixels[((size_t)by * blocks_x + bx) * block_bytes];
+                FetchBlock(image, bx, by, block);
+                if (format == TEXTURE_FORMAT_BC1)
+                    EncodeBC1Block(block, out);
+                else if (format == TEXTURE_FORMAT_BC3)
+                {
+                    EncodeBC3AlphaBlock(block, out);
+                    EncodeBC1Block(block, out + 8);
+                }
+                else
+                    EncodeBC7Block(block, out);
+            }
+    });
+}
+
+/*
+    压缩纹理的容器文件：文件头之后依次是每个级别的字节数与压缩数据，级别从原图开始。
+    数据按主机字节序(小端)写入。
+*/
+const char TEXTURE_CONTAINER_MAGIC[4] = { 'B', 'C', 'T', 'X' };
+
+struct TextureContainerHeader
+{
+    char magic[4];
+    uint32_t format;
+    uint32_t width, height;
+    uint32_t level_count;
+};
+
+bool WriteTextureContainer(const char* path, int format, const std::vector<Image>& levels)
+{
+    FILE* file = nullptr;
+#ifdef _WIN32
+    fopen_s(&file, path, "wb");
+#else
+    file = fopen(path, "wb");
+#endif
+    if (!file) return false;
+    TextureContainerHeader header;
+    memcpy(header.magic, TEXTURE_CONTAINER_MAGIC, 4);
+    header.format = format;
+    header.width = levels[0].width;
+    header.height = levels[0].height;
+    header.level_count = levels.size();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; i < levels.size() && ok; i++)
+    {
+        uint32_t size = levels[i].pixels.size();
+        ok = fwrite(&size, 4, 1, file) == 1 && fwrite(levels[i].pixels.data(), 1, size, file) == size;
+    }
+    fclose(file);
+    return ok;
+}
+
+/*
+    读取容器文件，levels 中保存各级别的压缩数据。级别数必须在 1 到完整 mipmap 链的级别数之间，
+    整个文件解析成功后才写入 format 与 levels，失败时两者保持不变。
+*/
+bool ReadTextureContainer(const std::vector<uint8_t>& file, int& format, std::vector<Image>& levels)
+{
+    TextureContainerHeader header;
+    if (file.size() < sizeof(header)) return false;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, TEXTURE_CONTAINER_MAGIC, 4) || header.format >= TEXTURE_FORMAT_COUNT ||
+        !TEXTURE_FORMATS[header.format].block_bytes || !header.width || !header.height) return false;
+    uint32_t max_levels = 1;
+    while ((std::max(header.width, header.height) >> max_levels) > 0) max_levels++;
+    if (header.level_count == 0 || header.level_count > max_levels) return false;
+    std::vector<Image> parsed(header.level_count);
+    size_t pos = sizeof(header);
+    for (uint32_t i = 0; i < header.level_count; i++)
+    {
+        uint32_t size;
+        if (pos + 4 > file.size()) return false;
+        memcpy(&size, &file[pos], 4);
+        parsed[i].width = std::max(1u, header.width >> i);
+        parsed[i].height = std::max(1u, header.height >> i);
+        if (size != TextureLevelBytes(header.format, parsed[i].width, parsed[i].height) || pos + 4 + size > file.size()) return false;
+        parsed[i].pixels.assign(file.begin() + pos + 4, file.begin() + pos + 4 + size);
+        pos += 4 + size;
+    }
+    format = header.format;
+    levels.swap(parsed);
+    return true;
+}
+
+/* 离线压缩：解码图像、生成 mipmap、逐级压缩后写入容器文件 */
+bool CompressTextureFile(const char* format_name, const char* input_path, const char* output_path)
+{
+    int format = 0;
+    while (format < TEXTURE_FORMAT_COUNT && (strcmp(TEXTURE_FORMATS[format].name, format_name) || !TEXTURE_FORMATS[format].block_bytes)) format++;
+    std::vector<uint8_t> file;
+    std::vector<Image> levels(1);
+    if (format == TEXTURE_FORMAT_COUNT || !ReadFileBytes(input_path, file) || !DecodeImage(file, levels[0]))
+    {
+        std::cout << "Failed to compress " << input_path << std::endl;
+        return false;
+    }
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    GenerateMipChain(levels);
+    std::vector<Image> compressed(levels.size());
+    size_t rgba8_bytes = 0, compressed_bytes = 0;
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        CompressLevel(levels[i], format, compressed[i]);
+        rgba8_bytes += levels[i].pixels.size();
+        compressed_bytes += compressed[i].pixels.size();
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    if (!WriteTextureContainer(output_path, format, compressed))
+    {
+        std::cout << "Failed to write " << output_path << std::endl;
+        return false;
+    }
+    std::cout << "Compressed " << input_path << " (" << levels[0].width << "x" << levels[0].height << ", " << levels.size() << " levels) to "
+        << format_name << ": " << rgba8_bytes / 1048576.0 << "MB as RGBA8 -> " << compressed_bytes / 1048576.0 << "MB, "
+        << ms << "ms (" << rgba8_bytes / 4 / 1e6 / (ms * 1e-3) << " Mpixel/s, " << thread_pool.workers.size() + 1 << " threads)" << std::endl;
+    return true;
+}
+
+/*
+    纹理载入：工作线程读取并解码图像文件并生成 mipmap，各级别的 RGBA8 数据由主线程经过像素解包缓冲区(PBO)上传。
+    容器文件中已经压缩好的各级别直接上传。PBO 是一个持久映射的缓冲区，分为 UPLOAD_SLOT_COUNT 个槽，
+    每次把图像的一段行(压缩格式为一段块行)复制进一个槽后用 glTextureSubImage2D 或
+    glCompressedTextureSubImage2D 从槽中上传并插入栅栏。槽的栅栏还没有完成时本帧停止上传，下一帧继续，
+    渲染线程不会等待 GPU。
+*/
+const int UPLOAD_SLOT_COUNT = 4;
+const size_t UPLOAD_SLOT_SIZE = 4 << 20;
+
+struct TextureRequest
+{
+    std::string path;
+    /* levels[0] 为原图，之后是各级 mipmap；压缩格式时 pixels 中保存压缩数据 */
+    std::vector<Image> levels;
+    int format;
+    bool decoded;
+    size_t file_bytes;
+    double decode_ms, mip_ms;
+    std::chrono::steady_clock::time_point decode_end;
+    uint32_t texture;
+    int uploaded_level, uploaded_rows;
+    /* 最后一段行上传之后插入的栅栏 */
+    GLsync fence;
+};
+
+/* 解码用的工作线程池，请求按提交顺序处理，完成后放入 decoded 队列 */
+struct DecodePool
+{
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<TextureRequest*> pending;
+    std::vector<TextureRequest*> decoded;
+    bool quit = false;
+
+    void Start(int count)
+    {
+        for (int i = 0; i < count; i++)
+            workers.push_back(std::thread([this]() { WorkerLoop(); }));
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cv.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+        workers.clear();
+    }
+
+    void Submit(TextureRequest* request)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(request);
+        }
+        cv.notify_one();
+    }
+
+    /* 取出已经解码完成的请求 */
+    void TakeDecoded(std::vector<TextureRequest*>& out)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        out.insert(out.end(), decoded.begin(), decoded.end());
+        decoded.clear();
+    }
+
+    void WorkerLoop()
+    {
+        for (;;)
+        {
+            TextureRequest* request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return quit || !pending.empty(); });
+                if (quit) return;
+                request = pending.front();
+                pending.pop_front();
+            }
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            std::vector<uint8_t> file;
+            request->levels.resize(1);
+            request->format = TEXTURE_FORMAT_RGBA8;
+            bool compressed = false;
+            request->decoded = ReadFileBytes(request->path.c_str(), file) &&
+                ((compressed = ReadTextureContainer(file, request->format, request->levels)) || DecodeImage(file, request->levels[0]));
+            request->file_bytes = file.size();
+            std::chrono::steady_clock::time_point decode_done = std::chrono::steady_clock::now();
+            request->decode_ms = std::chrono::duration<double, std::milli>(decode_done - begin).count();
+            if (request->decoded && !compressed) GenerateMipChain(request->levels);
+            request->decode_end = std::chrono::steady_clock::now();
+            request->mip_ms = std::chrono::duration<double, std::milli>(request->decode_end - decode_done).count();
+            std::lock_guard<std::mutex> lock(mutex);
+            decoded.push_back(request);
+        }
+    }
+};
+
+DecodePool decode_pool;
+
+struct UploadRing
+{
+    uint32_t buffer;
+    uint8_t* mapped;
+    GLsync fences[UPLOAD_SLOT_COUNT];
+    int next;
+
+    void Create()
+    {
+        glCreateBuffers(1, &buffer);
+        const uint32_t flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glNamedBufferStorage(buffer, UPLOAD_SLOT_SIZE * UPLOAD_SLOT_COUNT, nullptr, flags);
+        mapped = (uint8_t*)glMapNamedBufferRange(buffer, 0, UPLOAD_SLOT_SIZE * UPLOAD_SLOT_COUNT, flags);
+        for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) fences[i] = nullptr;
+        next = 0;
+    }
+
+    /* 下一个槽可以写入时返回其编号，GPU 还在读取时返回 -1 */
+    int Acquire()
+    {
+        GLsync& fence = fences[next];
+        if (fence)
+        {
+            GLenum status = glClientWaitSync(fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED) return -1;
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+        return next;
+    }
+
+    void Release(int slot)
+    {
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        next = (next + 1) % UPLOAD_SLOT_COUNT;
+    }
+};
+
+UploadRing upload_ring;
+
+/* 正在上传与等待上传完成的请求，均由主线程访问 */
+std::deque<TextureRequest*> uploading;
+std::vector<TextureRequest*> upload_in_flight;
+
+/* 载入完成的纹理，按完成顺序排列 */
+std::vector<TextureRequest*> loaded_textures;
+int current_texture = -1;
+
+struct TextureLoadStats
+{
+    int submitted, loaded, failed;
+    uint64_t file_bytes, decoded_bytes;
+    /* 所有纹理在 GPU 中占用的字节数，以及同样的纹理按原来的 GL_RGB32F 存储时占用的字节数 */
+    uint64_t gpu_bytes, rgb32f_bytes;
+    double decode_ms, mip_ms, upload_latency_ms;
+    std::chrono::steady_clock::time_point begin;
+};
+
+TextureLoadStats texture_stats;
+
+void LoadTextureAsync(const char* path)
+{
+    TextureRequest* request = new TextureRequest();
+    request->path = path;
+    request->texture = 0;
+    request->uploaded_level = request->uploaded_rows = 0;
+    request->fence = nullptr;
+    if (!texture_stats.submitted++) texture_stats.begin = std::chrono::steady_clock::now();
+    decode_pool.Submit(request);
+}
+
+/* 所有请求都已完成(载入或失败)时输出汇总，最后完成的请求可能是解码失败的 */
+void ReportTextureLoadingIfDone()
+{
+    if (texture_stats.loaded + texture_stats.failed != texture_stats.submitted) return;
+    double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - texture_stats.begin).count();
+    std::cout << "Texture loading finished: " << texture_stats.loaded << " loaded, " << texture_stats.failed << " failed, "
+        << texture_stats.file_bytes / 1048576.0 << "MB read, " << texture_stats.decoded_bytes / 1048576.0 << "MB decoded, "
+        << "decode " << texture_stats.decoded_bytes / 1048576.0 / (texture_stats.decode_ms * 1e-3) << "MB/s of summed decode time ("
+        << decode_pool.workers.size() << " threads, " << texture_stats.decoded_bytes / 1048576.0 / (wall_ms * 1e-3) << "MB/s overall), "
+        << "mipmaps " << texture_stats.decoded_bytes / 1048576.0 / (texture_stats.mip_ms * 1e-3) << "MB/s, "
+        << "average upload latency " << texture_stats.upload_latency_ms / std::max(texture_stats.loaded, 1) << "ms, total "
+        << wall_ms << "ms" << std::endl;
+    std::cout << "Texture memory: " << texture_stats.gpu_bytes / 1048576.0 << "MB (" << texture_stats.rgb32f_bytes / 1048576.0
+        << "MB as GL_RGB32F, saved " << (texture_stats.rgb32f_bytes - texture_stats.gpu_bytes) / 1048576.0 << "MB)" << std::endl;
+}
+
+/* 每帧调用一次：为解码完成的图像创建纹理，在不等待 GPU 的前提下尽量多地上传，并检查上传是否完成 */
+void PumpTextureUploads()
+{
+    std::vector<TextureRequest*> decoded;
+    decode_pool.TakeDecoded(decoded);
+    for (size_t i = 0; i < decoded.size(); i++)
+    {
+        TextureRequest* request = decoded[i];
+        if (!request->decoded)
+        {
+            std::cout << "Failed to load " << request->path << std::endl;
+            texture_stats.failed++;
+            delete request;
+            ReportTextureLoadingIfDone();
+            continue;
+        }
+        texture_stats.file_bytes += request->file_bytes;
+        texture_stats.decoded_bytes += request->levels[0].pixels.size();
+        texture_stats.decode_ms += request->decode_ms;
+        texture_stats.mip_ms += request->mip_ms;
+        for (size_t level = 0; level < request->levels.size(); level++)
+        {
+            texture_stats.gpu_bytes += TextureLevelBytes(request->format, request->levels[level].width, request->levels[level].height);
+            texture_stats.rgb32f_bytes += (size_t)request->levels[level].width * request->levels[level].height * 12;
+        }
+        glCreateTextures(GL_TEXTURE_2D, 1, &request->texture);
+        glTextureStorage2D(request->texture, request->levels.size(), TextureInternalFormat(request->format), request->levels[0].width, request->levels[0].height);
+        uploading.push_back(request);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_ring.buffer);
+    /* 一行超过一个槽的图像直接从内存上传，不占用槽，每帧最多上传 UPLOAD_SLOT_COUNT 次 */
+    int direct_uploads = 0;
+    while (!uploading.empty())
+    {
+        TextureRequest* request = uploading.front();
+        const Image& image = request->levels[request->uploaded_level];
+        /* 压缩格式以 4 行(一行块)为单位上传 */
+        bool block_compressed = TEXTURE_FORMATS[request->format].block_bytes != 0;
+        int unit_rows = block_compressed ? 4 : 1;
+        size_t unit_bytes = TextureLevelBytes(request->format, image.width, unit_rows);
+        int units = (int)std::max<size_t>(1, UPLOAD_SLOT_SIZE / unit_bytes);
+        int rows = std::min(image.height - request->uploaded_rows, units * unit_rows);
+        size_t bytes = unit_bytes * ((rows + unit_rows - 1) / unit_rows);
+        bool direct = unit_bytes > UPLOAD_SLOT_SIZE;
+        int slot = -1;
+        if (direct)
+        {
+            if (direct_uploads++ == UPLOAD_SLOT_COUNT) break;
+        }
+        else if ((slot = upload_ring.Acquire()) < 0)
+            break;
+        const void* source = &image.pixels[unit_bytes * (request->uploaded_rows / unit_rows)];
+        if (direct)
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        else
+        {
+            memcpy(upload_ring.mapped + UPLOAD_SLOT_SIZE * slot, source, bytes);
+            source = (const void*)(UPLOAD_SLOT_SIZE * slot);
+        }
+        if (block_compressed)
+            glCompressedTextureSubImage2D(request->texture, request->uploaded_level, 0, request->uploaded_rows, image.width, rows,
+                TextureInternalFormat(request->format), bytes, source);
+        else
+            glTextureSubImage2D(request->texture, request->uploaded_level, 0, request->uploaded_rows, image.width, rows, GL_RGBA, GL_UNSIGNED_BYTE, source);
+        /* 只有作为 PBO 数据源的槽才需要栅栏 */
+        if (direct)
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_ring.buffer);
+        else
+            upload_ring.Release(slot);
+        request->uploaded_rows += rows;
+        if (request->uploaded_rows == image.height)
+        {
+            request->uploaded_level++;
+            request->uploaded_rows = 0;
+        }
+        if (request->uploaded_level == (int)request->levels.size())
+        {
+            request->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            upload_in_flight.push_back(request);
+            uploading.pop_front();
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    /* 上传延迟为解码完成到观察到最后一段上传完成的时间，精度为一帧 */
+    for (size_t i = 0; i < upload_in_flight.size(); )
+    {
+        TextureRequest* request = upload_in_flight[i];
+        GLenum status = glClientWaitSync(request->fence, 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+        {
+            i++;
+            continue;
+        }
+        glDeleteSync(request->fence);
+        request->fence = nullptr;
+        double latency_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - request->decode_end).count();
+        texture_stats.upload_latency_ms += latency_ms;
+        texture_stats.loaded++;
+        const Image& image = request->levels[0];
+        std::cout << "Loaded " << request->path << " (" << image.width << "x" << image.height << ", " << request->levels.size() << " levels, "
+            << TEXTURE_FORMATS[request->format].name << "): decode "
+            << request->decode_ms << "ms (" << image.pixels.size() / 1048576.0 / (request->decode_ms * 1e-3) << "MB/s), mipmaps "
+            << request->mip_ms << "ms, upload latency " << latency_ms << "ms" << std::endl;
+        /* 上传完成后不再需要 CPU 端的像素数据 */
+        for (size_t level = 0; level < request->levels.size(); level++)
+            std::vector<uint8_t>().swap(request->levels[level].pixels);
+        loaded_textures.push_back(request);
+        if (current_texture < 0) current_texture = 0;
+        upload_in_flight.erase(upload_in_flight.begin() + i);
+        ReportTextureLoadingIfDone();
+    }
+}
+
+/* 采样方式，每种方式对应一个采样器对象，在 InitAssets 中创建一次 */
+enum SamplerMode { SAMPLER_NEAREST, SAMPLER_BILINEAR, SAMPLER_TRILINEAR, SAMPLER_ANISOTROPIC, SAMPLER_MODE_COUNT };
+const char* SAMPLER_MODE_NAMES[SAMPLER_MODE_COUNT] = { "nearest", "bilinear", "trilinear", "anisotropic" };
+const float MAX_ANISOTROPY = 16.0f;
+
+uint32_t sampler_objects[SAMPLER_MODE_COUNT];
+int sampler_mode = SAMPLER_ANISOTROPIC;
+
+void CreateSamplers()
+{
+    static const int32_t MIN_FILTERS[SAMPLER_MODE_COUNT] = { GL_NEAREST, GL_LINEAR, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR_MIPMAP_LINEAR };
+    float max_anisotropy = 1.0f;
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY, &max_anisotropy);
+    glCreateSamplers(SAMPLER_MODE_COUNT, sampler_objects);
+    for (int i = 0; i < SAMPLER_MODE_COUNT; i++)
+    {
+        glSamplerParameteri(sampler_objects[i], GL_TEXTURE_MIN_FILTER, MIN_FILTERS[i]);
+        glSamplerParameteri(sampler_objects[i], GL_TEXTURE_MAG_FILTER, i == SAMPLER_NEAREST ? GL_NEAREST : GL_LINEAR);
+        glSamplerParameteri(sampler_objects[i], GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glSamplerParameteri(sampler_objects[i], GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glSamplerParameterf(sampler_objects[SAMPLER_ANISOTROPIC], GL_TEXTURE_MAX_ANISOTROPY, std::min(MAX_ANISOTROPY, max_anisotropy));
+}
+
+/* 没有指定文件时载入书中的插图，路径相对于本示例的目录 */
+const char* DEFAULT_TEXTURE_FILES[] = {
+    "../../../../book/imgs/sec 5.1/texture.bmp",
+    "../../../../book/imgs/sec 5.1/texture.png",
+    "../../../../book/imgs/sec 5.2/texture.png",
+    "../../../../book/imgs/sec 5.2/texture-repeat.bmp",
+    "../../../../book/imgs/sec 5.2/texture-mirror.bmp",
+    "../../../../book/imgs/sec 5.2/texture-clamp-edge.png",
+    "../../../../book/imgs/sec 5.2/texture-clamp-to-border.png",
+    "../../../../book/imgs/sec 3.2/programmable-rendering-pipeline.png",
+    "../../../../book/imgs/sec 3.3/vertex-attrib.png",
+};
+
 uint32_t CompileGLSLShaderFromFile(
     const char* shader_file_path,
     uint32_t shader_type
@@ -116,19 +1456,60 @@ void InitAssets()
 
     glCreateTextures(GL_TEXTURE_2D, 1, &texture_object);
     glBindTexture(GL_TEXTURE_2D, texture_object);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, 256, 256, 0, GL_RGB, GL_UNSIGNED_BYTE, pixel_data);
+    glTexImage2D(GL_TEXTURE_2D, 0, TextureInternalFormat(TEXTURE_FORMAT_RGBA8), 256, 256, 0, GL_RGB, GL_UNSIGNED_BYTE, pixel_data);
+    /* 只有一级，使用带 mipmap 的采样方式时也是完整的纹理 */
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
     glBindTexture(GL_TEXTURE_2D, 0);
+
+    CreateSamplers();
+    glBindSampler(0, sampler_objects[sampler_mode]);
+
+    upload_ring.Create();
+    decode_pool.Start(std::max(1, (int)std::thread::hardware_concurrency() - 1));
+}
+
+/* 按下时返回 true，按住不会重复触发 */
+bool KeyPressed(GLFWwindow* window, int key)
+{
+    static bool key_down[GLFW_KEY_LAST + 1];
+    bool down = glfwGetKey(window, key) == GLFW_PRESS;
+    bool pressed = down && !key_down[key];
+    key_down[key] = down;
+    return pressed;
 }
 
-int main(void)
+/*
+    命令行参数为要载入的 BMP/PNG 文件，左右方向键切换显示的纹理，F 键切换采样方式。
+    参数为 --mip-benchmark 时只测量 mipmap 生成的吞吐量；
+    参数为 --compress bc1|bc3|bc7 输入文件 输出文件 时离线压缩纹理，输出的容器文件也可以作为参数载入。
+*/
+int main(int argc, char** argv)
 {
     GLFWwindow* window;
 
+    InitColorTables();
+    thread_pool.Start(std::max(1, (int)std::thread::hardware_concurrency() - 1));
+    if (argc > 1 && !strcmp(argv[1], "--mip-benchmark"))
+    {
+        RunMipBenchmark();
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "--compress"))
+    {
+        if (argc != 5)
+        {
+            std::cout << "Usage: main --compress bc1|bc3|bc7 input output" << std::endl;
+            return -1;
+        }
+        return CompressTextureFile(argv[2], argv[3], argv[4]) ? 0 : -1;
+    }
+
     /* 初始化 GLFW 库 */
     if (!glfwInit())
         return -1;
 
     /* 创建窗口 */
+    if (SRGB_TEXTURES) glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
     window = glfwCreateWindow(640, 480, "Texture", NULL, NULL);
     if (!window)
     {
@@ -154,10 +1535,32 @@ int main(void)
     /* 调用初始化函数 */
 
     InitAssets();
+    if (SRGB_TEXTURES) glEnable(GL_FRAMEBUFFER_SRGB);
+    if (argc > 1)
+        for (int i = 1; i < argc; i++) LoadTextureAsync(argv[i]);
+    else
+        for (size_t i = 0; i < sizeof(DEFAULT_TEXTURE_FILES) / sizeof(DEFAULT_TEXTURE_FILES[0]); i++)
+            LoadTextureAsync(DEFAULT_TEXTURE_FILES[i]);
 
     /* 消息循环 */
     while (!glfwWindowShouldClose(window))
     {
+        PumpTextureUploads();
+        if (!loaded_textures.empty())
+        {
+            int count = (int)loaded_textures.size();
+            int previous = current_texture;
+            if (KeyPressed(window, GLFW_KEY_RIGHT)) current_texture = (current_texture + 1) % count;
+            if (KeyPressed(window, GLFW_KEY_LEFT)) current_texture = (current_texture + count - 1) % count;
+            if (current_texture != previous) std::cout << "Showing " << loaded_textures[current_texture]->path << std::endl;
+        }
+        if (KeyPressed(window, GLFW_KEY_F))
+        {
+            sampler_mode = (sampler_mode + 1) % SAMPLER_MODE_COUNT;
+            glBindSampler(0, sampler_objects[sampler_mode]);
+            std::cout << "Sampler: " << SAMPLER_MODE_NAMES[sampler_mode] << std::endl;
+        }
+
         /* 在这里实现渲染代码 */
         glClearColor(0.6, 0.7, 0.8, 1.0);
         glClear(GL_COLOR_BUFFER_BIT);
@@ -173,11 +1576,8 @@ int main(void)
         glEnableVertexAttribArray(1);
 
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_object);
-        glBindTexture(GL_TEXTURE_2D, texture_object);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        /* 还没有纹理载入完成时显示程序生成的图案 */
+        glBindTexture(GL_TEXTURE_2D, current_texture < 0 ? texture_object : loaded_textures[current_texture]->texture);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr);
 
         /* 交换缓冲 */
@@ -187,6 +1587,7 @@ int main(void)
         glfwPollEvents();
     }
 
+    decode_pool.Stop();
     glfwTerminate();
     return 0;
 }
\ No newline at end of file
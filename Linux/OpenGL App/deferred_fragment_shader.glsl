@@ -0,0 +1,42 @@
+#version 450 core
+
+out vec4 color0;
+
+/* 几何阶段写入的 G-buffer，见 gbuffer_fragment_shader.glsl */
+layout (binding = 4) uniform sampler2D gbuffer_albedo;
+layout (binding = 5) uniform sampler2D gbuffer_normal;
+layout (binding = 6) uniform sampler2D gbuffer_depth;
+
+#include "lighting.glsl"
+
+vec3 DecodeNormal(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+/* 每个像素只计算一次光照，位置由深度重建 */
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gbuffer_depth, pixel, 0).r;
+    if (depth == 1.0)
+    {
+        color0 = vec4(0.0, 0.0, 0.0, 1.0);
+        return;
+    }
+    vec4 albedo = texelFetch(gbuffer_albedo, pixel, 0);
+    if (albedo.a > 0.5)
+    {
+        color0 = vec4(albedo.rgb, 1.0);
+        return;
+    }
+
+    vec3 ndc = vec3(gl_FragCoord.xy / viewport_size, depth) * 2.0 - 1.0;
+    float z = proj_params.w / (ndc.z - proj_params.z);
+    vec4 view_pos = vec4(ndc.x * z / proj_params.x, ndc.y * z / proj_params.y, z, 1.0);
+    vec4 view_norm = vec4(DecodeNormal(texelFetch(gbuffer_normal, pixel, 0).xy), 0.0);
+    color0 = vec4(ShadeSurface(albedo.rgb, mat_view_inverse*view_pos, view_pos, view_norm), 1.0);
+}
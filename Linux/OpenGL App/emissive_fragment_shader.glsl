@@ -0,0 +1,11 @@
+#version 450 core
+
+in vec3 fs_color;
+
+/* 前向路径中直接输出颜色；延迟路径中写入 G-buffer 的反照率，alpha 为 1 表示自发光，法线不写入 */
+layout (location = 0) out vec4 color0;
+
+void main()
+{
+    color0 = vec4(fs_color, 1.0);
+}
@@ -0,0 +1,23 @@
+#version 460 core
+
+layout (location = 0) in vec3 vs_pos;
+
+struct DrawData
+{
+    vec4 color;
+};
+
+layout (std430, binding = 0) readonly buffer DrawDataBuffer
+{
+    DrawData draw_data[];
+};
+
+out vec3 fs_color;
+
+#include "frame_constants.glsl"
+
+void main()
+{
+    fs_color = draw_data[gl_DrawID].color.rgb;
+    gl_Position = mat_proj*(mat_trans*vec4(vs_pos, 1.0));
+}
@@ -0,0 +1,18 @@
+#version 450 core
+
+in vec4 fs_norm;
+in vec4 fs_pos;
+in vec3 fs_color;
+in vec4 fs_view_pos;
+in vec4 fs_view_norm;
+
+out vec4 color0;
+
+#include "frame_constants.glsl"
+
+/* 光照变体编译完成之前使用的简化着色：环境光与不带阴影的漫反射平行光 */
+void main()
+{
+    float costheta = max(dot(normalize(fs_view_norm.xyz), -light_direction.xyz), 0.0);
+    color0 = vec4(fs_color * (0.1 + 0.9 * costheta), 1.0);
+}
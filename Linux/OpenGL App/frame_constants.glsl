@@ -0,0 +1,33 @@
+/* 被各着色器包含，不单独编译 */
+
+const int MAX_SHADOW_CASCADES = 4;
+
+/* 每帧的常量，布局 (std140) 与 main.cpp 中的 FrameConstants 一致 */
+layout (std140, binding = 0) uniform FrameConstantBlock
+{
+    mat4 mat_proj;
+    mat4 mat_trans;
+    mat4 mat_view_inverse;
+    mat4 mat_depth[MAX_SHADOW_CASCADES];
+    /* 每个级联在深度图集中的区域(起点与大小) */
+    vec4 cascade_rect[MAX_SHADOW_CASCADES];
+    /* 每个分量对应一个级联：覆盖的最远视点距离，以及深度差(0 到 1)对应的半影宽度(以级联像素为单位) */
+    vec4 cascade_far;
+    vec4 cascade_penumbra;
+    /* 观察空间中的平行光方向 */
+    vec4 light_direction;
+    /* 投影矩阵中的 (m00, m11, m22, m32)，规格化设备坐标的深度为 m22 + m32 / z */
+    vec4 proj_params;
+    ivec4 cluster_grid;
+    /* 像素坐标乘以该值得到块坐标 */
+    vec2 cluster_tile_scale;
+    /* 层号 = log(z) * x - y */
+    vec2 cluster_depth_params;
+    vec2 viewport_size;
+    vec2 evsm_exponents;
+    int cascade_count;
+    float shadow_filter_radius;
+    float shadow_bleed_reduction;
+    float shadow_min_variance;
+    float Kq, Kp, Kc;
+};
@@ -0,0 +1,27 @@
+#version 450 core
+
+in vec4 fs_norm;
+in vec4 fs_pos;
+in vec3 fs_color;
+in vec4 fs_view_pos;
+in vec4 fs_view_norm;
+
+/* rgb 为反照率，a 为自发光标记，受光照的物体写入 0，自发光物体由 emissive_fragment_shader.glsl 写入 1 */
+layout (location = 0) out vec4 gbuffer_albedo;
+/* 八面体编码的观察空间法线 */
+layout (location = 1) out vec2 gbuffer_normal;
+
+/* 把单位向量投影到八面体 |x| + |y| + |z| = 1 上，下半部分翻折到外侧的四个三角形，得到 [-1, 1] 中的两个分量 */
+vec2 EncodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return n.xy;
+}
+
+void main()
+{
+    gbuffer_albedo = vec4(fs_color, 0.0);
+    gbuffer_normal = EncodeNormal(normalize(fs_view_norm.xyz));
+}
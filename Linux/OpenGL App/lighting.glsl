@@ -0,0 +1,251 @@
+/*
+    光照计算，被前向着色与延迟光照的片段着色器包含。
+    以下宏由 main.cpp 中的着色器变体缓存在 #version 之后注入，循环次数因此成为编译期常量：
+    SHADOW_FILTER_MODE   阴影过滤方式
+    SHADOW_FILTER_TAPS   泊松圆盘与 PCSS 的采样数
+    SHADOW_GRID_RADIUS   规则网格的半径，网格为 (2 * SHADOW_GRID_RADIUS + 1)^2
+    DISNEY_DIFFUSE       定义时漫反射使用 Disney 模型，否则使用 Lambert 模型
+*/
+
+#include "frame_constants.glsl"
+
+const int MAX_SHADOW_FILTER_TAPS = 32;
+
+#define SHADOW_FILTER_GRID 0
+#define SHADOW_FILTER_POISSON 1
+#define SHADOW_FILTER_PCSS 2
+#define SHADOW_FILTER_VSM 3
+#define SHADOW_FILTER_EVSM 4
+
+#ifndef SHADOW_FILTER_MODE
+#define SHADOW_FILTER_MODE SHADOW_FILTER_POISSON
+#endif
+#ifndef SHADOW_FILTER_TAPS
+#define SHADOW_FILTER_TAPS 16
+#endif
+#ifndef SHADOW_GRID_RADIUS
+#define SHADOW_GRID_RADIUS 8
+#endif
+
+/* 泊松圆盘采样点，按最远点顺序排列，任意前 n 个点都分布均匀 */
+const vec2 poisson_disk[MAX_SHADOW_FILTER_TAPS] = vec2[](
+    vec2(0.0987, 0.0369), vec2(-0.6380, 0.7113), vec2(-0.6227, -0.6128), vec2(0.6852, -0.7284),
+    vec2(0.6800, 0.6001), vec2(-0.7664, -0.0559), vec2(0.1332, -0.7836), vec2(0.5787, -0.1491),
+    vec2(-0.2052, 0.4624), vec2(0.0492, -0.3996), vec2(-0.4050, 0.0707), vec2(0.6628, 0.2805),
+    vec2(-0.3308, 0.7789), vec2(0.4468, 0.0916), vec2(0.3990, -0.7202), vec2(-0.3572, -0.5563),
+    vec2(-0.6950, 0.4463), vec2(-0.7232, -0.3233), vec2(-0.1096, -0.6983), vec2(-0.1150, -0.2037),
+    vec2(0.4288, 0.5738), vec2(0.2822, -0.4979), vec2(0.5839, -0.3969), vec2(-0.4831, 0.3038),
+    vec2(0.3424, -0.1971), vec2(-0.4564, -0.1640), vec2(-0.1660, 0.0902), vec2(0.2519, 0.2287),
+    vec2(-0.6945, 0.1712), vec2(0.0092, 0.2565), vec2(0.0299, 0.4915), vec2(-0.4227, 0.5631)
+);
+
+/* 同一张深度图集：带硬件比较与线性过滤的采样器，以及读取原始深度的采样器 */
+layout (binding = 0) uniform sampler2DShadow shadow_map;
+layout (binding = 1) uniform sampler2D depth_map;
+/* 模糊并生成了 mipmap 的矩纹理，VSM 使用 xy，EVSM 使用全部四个分量 */
+layout (binding = 2) uniform sampler2D moments_map;
+
+/* 点光源按簇组织，见 main.cpp 中的 LightClusterGrid */
+struct PointLight
+{
+    vec4 position_range;    /* 观察空间中的位置与作用范围 */
+    vec4 color;
+};
+
+layout (std430, binding = 1) readonly buffer PointLightBuffer
+{
+    PointLight point_lights[];
+};
+
+/* 每个簇的光源列表在 light_indices 中的起始位置与个数 */
+layout (std430, binding = 2) readonly buffer LightClusterBuffer
+{
+    uvec2 light_clusters[];
+};
+
+layout (std430, binding = 3) readonly buffer LightIndexBuffer
+{
+    uint light_indices[];
+};
+
+float PI = 3.14159265358979323846264338327950288419716939937510;
+float INV_PI = 1.0 / PI;
+
+float lambertian(vec3 vNorm, vec3 vIn, vec3 vOut) { return 1.0; }
+
+float disney_diffuse(vec3 vNorm, vec3 vIn, vec3 vOut)
+{
+    vec3 vHalf = normalize(vIn + vOut);
+    float cos_theta_d = dot(vHalf, vNorm);
+    float cos_theta_i = dot(vIn, vNorm);
+    float cos_theta_o = dot(vOut, vNorm);
+    float FD90 = 0.5 + 2 * cos_theta_d * cos_theta_d;
+    return (1.0+(FD90-1.0)*pow(1.0-cos_theta_i, 5.0))*(1.0+(FD90-1.0)*pow(1.0-cos_theta_o, 5.0));
+}
+
+float blinn_phong(vec3 vNorm, vec3 vIn, vec3 vOut)
+{
+    vec3 vHalf = normalize(vIn + vOut);
+    return pow(dot(vHalf, vNorm), 100.0);
+}
+
+float mixed(vec3 vNorm, vec3 vIn, vec3 vOut)
+{
+#ifdef DISNEY_DIFFUSE
+    return disney_diffuse(vNorm, vIn, vOut) + blinn_phong(vNorm, vIn, vOut);
+#else
+    return lambertian(vNorm, vIn, vOut) + blinn_phong(vNorm, vIn, vOut);
+#endif
+}
+
+vec3 point_light(vec3 light_pos, float light_range, vec3 light_color, vec4 frag_pos, vec4 frag_norm)
+{
+    float d = distance(vec4(light_pos, 1.0), frag_pos);
+    if (d >= light_range) return vec3(0.0, 0.0, 0.0);
+    /* 在作用范围的边界处平滑地降到 0 */
+    float window = 1.0 - pow(d / light_range, 4.0);
+    float costheta = max(dot(frag_norm, normalize(vec4(light_pos, 1.0) - frag_pos)), 0.0);
+    if (costheta == 0.0) return vec3(0.0, 0.0, 0.0);
+    return 
+    costheta
+    * mixed(frag_norm.xyz,normalize(light_pos-frag_pos.xyz),normalize(-frag_pos.xyz))
+    * light_color * window * window / (Kq * d * d + Kp * d + Kc);
+}
+
+vec3 parallel_light(vec3 light_direction, vec3 light_color, vec4 frag_pos, vec4 frag_norm)
+{
+    float costheta = max(dot(frag_norm.xyz, -light_direction), 0.0);
+    if (costheta == 0.0) return vec3(0.0, 0.0, 0.0);
+    return 
+    costheta
+    *
+    mixed(frag_norm.xyz, -light_direction, normalize(-frag_pos.xyz))
+    * light_color;
+}
+
+/* 由深度的均值与方差给出深度不小于 t 的概率上界 */
+float Chebyshev(vec2 moments, float t, float min_variance)
+{
+    if (t <= moments.x) return 1.0;
+    float variance = max(moments.y - moments.x * moments.x, min_variance);
+    float d = t - moments.x;
+    return variance / (variance + d * d);
+}
+
+/* 低于 amount 的上界视为完全遮挡，其余部分重新映射到 [0, 1]，以抑制光渗透 */
+float ReduceLightBleeding(float p, float amount)
+{
+    return clamp((p - amount) / (1.0 - amount), 0.0, 1.0);
+}
+
+float CheckLightVisibility(vec4 pos, float view_depth)
+{
+    int cascade = 0;
+    while (cascade < cascade_count && view_depth > cascade_far[cascade]) cascade++;
+    if (cascade == cascade_count) return 1.0;
+
+    pos = mat_depth[cascade]*pos;
+    if (pos.x < -1.0 || pos.x > 1.0) return 1.0;
+    if (pos.y < -1.0 || pos.y > 1.0) return 1.0;
+    if (pos.z < -1.0 || pos.z > 1.0) return 1.0;
+    pos = (pos + vec4(1.0, 1.0, 1.0, 1.0)) * 0.5;
+
+    /* 采样点限制在当前级联的区域内，避免读到相邻级联 */
+    vec4 rect = cascade_rect[cascade];
+    vec2 texel = 1.0 / vec2(textureSize(depth_map, 0));
+    vec2 uv = rect.xy + pos.xy * rect.zw;
+    vec2 uv_min = rect.xy + texel * 0.5, uv_max = rect.xy + rect.zw - texel * 0.5;
+    float depth = pos.z / 1.001;
+
+#if SHADOW_FILTER_MODE == SHADOW_FILTER_VSM || SHADOW_FILTER_MODE == SHADOW_FILTER_EVSM
+    /*
+        矩纹理的 mipmap 按级联分别生成，级别数受最小的级联限制。
+        三线性过滤会读取向上取整的那一级，按该级的像素大小内缩，双线性的采样点也不会越过级联的边界。
+    */
+    float moments_lod = textureQueryLod(moments_map, uv).x;
+    vec2 moments_texel = texel * exp2(ceil(moments_lod));
+    vec4 moments = textureLod(moments_map, clamp(uv, rect.xy + moments_texel * 0.5, rect.xy + rect.zw - moments_texel * 0.5), moments_lod);
+#if SHADOW_FILTER_MODE == SHADOW_FILTER_VSM
+    float visibility = Chebyshev(moments.xy, pos.z, shadow_min_variance);
+#else
+    /* 最小方差按指数变换在该深度处的导数缩放 */
+    float w = pos.z * 2.0 - 1.0;
+    float p = exp(evsm_exponents.x * w), n = -exp(-evsm_exponents.y * w);
+    float p_scale = evsm_exponents.x * p, n_scale = evsm_exponents.y * n;
+    float visibility = min(
+        Chebyshev(moments.xy, p, shadow_min_variance * p_scale * p_scale),
+        Chebyshev(moments.zw, n, shadow_min_variance * n_scale * n_scale));
+#endif
+    return ReduceLightBleeding(visibility, shadow_bleed_reduction);
+
+#elif SHADOW_FILTER_MODE == SHADOW_FILTER_GRID
+    float res = 0.0;
+    for (int i = -SHADOW_GRID_RADIUS; i <= SHADOW_GRID_RADIUS; i++)
+        for (int j = -SHADOW_GRID_RADIUS; j <= SHADOW_GRID_RADIUS; j++)
+            res += texture(shadow_map, vec3(clamp(uv + vec2(i, j) * texel, uv_min, uv_max), depth));
+    return res * (1.0 / float((SHADOW_GRID_RADIUS*2+1) * (SHADOW_GRID_RADIUS*2+1)));
+
+#else
+    /* 每个像素把泊松圆盘旋转一个随机角度，把规则的条纹变为噪点 */
+    float angle = 6.2831853 * fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+    mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+    float radius = shadow_filter_radius;
+
+#if SHADOW_FILTER_MODE == SHADOW_FILTER_PCSS
+    /* 在两倍过滤半径内搜索比当前点更靠近光源的遮挡物，由平均遮挡深度估计半影宽度 */
+    float blocker_depth = 0.0;
+    int blockers = 0;
+    for (int i = 0; i < SHADOW_FILTER_TAPS; i++)
+    {
+        float d = texture(depth_map, clamp(uv + rotation * poisson_disk[i] * (radius * 2.0) * texel, uv_min, uv_max)).r;
+        if (d < depth)
+        {
+            blocker_depth += d;
+            blockers++;
+        }
+    }
+    if (blockers == 0) return 1.0;
+    blocker_depth /= float(blockers);
+    radius = clamp((depth - blocker_depth) * cascade_penumbra[cascade], 1.0, radius * 4.0);
+#endif
+
+    float res = 0.0;
+    for (int i = 0; i < SHADOW_FILTER_TAPS; i++)
+        res += texture(shadow_map, vec3(clamp(uv + rotation * poisson_disk[i] * radius * texel, uv_min, uv_max), depth));
+    return res / float(SHADOW_FILTER_TAPS);
+#endif
+}
+
+/* 计算表面受到的环境光、平行光(带阴影)与所在簇中点光源的光照，位置与法线同时给出世界空间与观察空间的值 */
+vec3 ShadeSurface(vec3 albedo, vec4 world_pos, vec4 view_pos, vec4 view_norm)
+{
+    vec3 lighting = vec3(0.0, 0.0, 0.0);
+    lighting += vec3(1.0, 1.0, 1.0)*0.1;
+
+    lighting +=
+    CheckLightVisibility(world_pos, view_pos.z) * 
+    0.9 *
+    parallel_light(
+        light_direction.xyz, 
+        vec3(1.0, 1.0, 1.0),
+        view_pos, 
+        view_norm);
+
+    ivec3 cluster = ivec3(
+        ivec2(gl_FragCoord.xy * cluster_tile_scale),
+        int(floor(log(view_pos.z) * cluster_depth_params.x - cluster_depth_params.y)));
+    cluster = clamp(cluster, ivec3(0), cluster_grid - 1);
+    uvec2 light_list = light_clusters[(cluster.z * cluster_grid.y + cluster.y) * cluster_grid.x + cluster.x];
+    for (uint i = 0; i < light_list.y; i++)
+    {
+        PointLight light = point_lights[light_indices[light_list.x + i]];
+        lighting += point_light(
+            light.position_range.xyz,
+            light.position_range.w,
+            light.color.rgb,
+            view_pos,
+            view_norm);
+    }
+
+    return albedo * lighting;
+}
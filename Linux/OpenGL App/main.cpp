@@ -2,10 +2,32 @@
 #include <GLFW/glfw3.h>
 #include <iostream>
 #include <cstring>
+#include <cstddef>
 #include <cstdint>
 #include <cmath>
+#include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
 #include <random>
+#include <memory>
+#include <unordered_map>
+#include <set>
+#include <string>
+#include <vector>
+#include "thread_pool.h"
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <immintrin.h>
+#define CULLING_SSE
+#endif
 
 const double pi = 3.14159265358979323846264338327950288419716939937510;
 
@@ -111,6 +133,7 @@ struct Vec3f
     Vec3f operator * (const float & scale) { return Vec3f(x*scale, y*scale, z*scale); }
     Vec3f operator + (const Vec3f & b) { return Vec3f(x+b.x, y+b.y, z+b.z); }
     Vec3f operator - (const Vec3f & b) { return Vec3f(x-b.x, y-b.y, z-b.z); }
+    bool operator == (const Vec3f & b) const { return x == b.x && y == b.y && z == b.z; }
 };
 
 float dot(Vec3f va, Vec3f vb) { return va.x*vb.x + va.y*vb.y + va.z*vb.z; }
@@ -145,12 +168,14 @@ Matrix fake_inverse(Matrix mat)
     return res;
 }
 
+/*
+    顶点中不再保存颜色，颜色属于物体，通过绘制命令对应的 DrawData 传给着色器。
+    是否自发光也属于物体，自发光物体与受光照物体分开绘制，见 RENDER_PASS_EMISSIVE。
+*/
 struct Vertex
 {
     Vec3f pos;
     Vec3f normal;
-    Vec3f color;
-    float flag;
 };
 
 struct TriInd
@@ -167,84 +192,2607 @@ const int BALL_ACCURACY = 40;
 Vec3f sphere_vertices[BALL_ACCURACY * (BALL_ACCURACY - 1) + 2];
 TriInd sphere_indices[(BALL_ACCURACY - 1) * BALL_ACCURACY * 2];
 
-Vertex vertex_buffer[3*1048576];
-TriInd index_buffer[1048576];
-uint32_t cnt_vertex, cnt_index;
+ThreadPool thread_pool;
+
+/*
+    按块增长的几何数据缓冲区。每帧在 ResetScene 中重置，已分配的内存会被保留到下一帧复用，
+    因此容量最终稳定在场景的最高用量附近。Allocate 返回新分配区域的起始下标，
+    超出 max_count 时输出错误并返回 UINT32_MAX。
 
-uint32_t vertex_buffer_object;
-uint32_t index_buffer_object;
+    通过 Attach 可以把写入目标切换到外部内存(持久映射的 GPU 缓冲区)，此时数据直接写入外部内存。
+    外部内存容量不足时转而写入堆内存并设置 overflowed，已写入的数据不再可用，
+    调用者需要扩大外部内存后重新生成本帧数据。
+*/
+template <typename T>
+struct GeometryArena
+{
+    T* data;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t high_water;
+    uint32_t chunk_size;
+    uint32_t max_count;
+
+    T* heap_data;
+    uint32_t heap_capacity;
+    bool attached;
+    bool overflowed;
+
+    GeometryArena(uint32_t _chunk_size, uint32_t _max_count)
+    {
+        data = heap_data = nullptr;
+        count = capacity = heap_capacity = high_water = 0;
+        chunk_size = _chunk_size;
+        max_count = _max_count;
+        attached = overflowed = false;
+    }
+    ~GeometryArena() { delete[] heap_data; }
 
-uint32_t shader_program_object;
+    bool CanAllocate(uint32_t n) const { return n <= max_count - count; }
 
-uint32_t depth_map_object;
-uint32_t depth_map_framebuffer_object;
-uint32_t depth_shader_program_object;
-const uint32_t SHADOW_WIDTH = 4096;
-const uint32_t SHADOW_HEIGHT = 4096;
+    /* 保证堆内存至少能容纳 n 个元素，keep 为真时保留已写入的数据 */
+    void ReserveHeap(uint32_t n, bool keep)
+    {
+        if (n <= heap_capacity) return;
+        uint64_t new_capacity = ((uint64_t)n + chunk_size - 1) / chunk_size * chunk_size;
+        if (new_capacity > max_count) new_capacity = max_count;
+        T* new_data = new T[new_capacity];
+        if (keep && heap_data) memcpy(new_data, heap_data, sizeof(T) * count);
+        delete[] heap_data;
+        heap_data = new_data;
+        heap_capacity = new_capacity;
+    }
 
-uint32_t tex_shader_program_object;
+    uint32_t Allocate(uint32_t n)
+    {
+        if (!CanAllocate(n))
+        {
+            std::cout << "GeometryArena overflow: " << count << " + " << n << " > " << max_count << std::endl;
+            return UINT32_MAX;
+        }
+        if (count + n > capacity)
+        {
+            if (attached)
+            {
+                /* 外部内存不足，本帧数据作废，之后的写入放到堆内存中以保证地址有效 */
+                overflowed = true;
+                attached = false;
+                ReserveHeap(count + n, false);
+            }
+            else
+                ReserveHeap(count + n, true);
+            data = heap_data;
+            capacity = heap_capacity;
+        }
+        uint32_t offset = count;
+        count += n;
+        if (count > high_water) high_water = count;
+        return offset;
+    }
+
+    void Attach(T* external_data, uint32_t external_capacity)
+    {
+        if (count > external_capacity)
+        {
+            overflowed = true;
+            if (count > high_water) high_water = count;
+            return;
+        }
+        if (count) memcpy(external_data, data, sizeof(T) * count);
+        data = external_data;
+        capacity = external_capacity;
+        attached = true;
+    }
+
+    void Detach()
+    {
+        data = heap_data;
+        capacity = heap_capacity;
+        attached = false;
+    }
+
+    void Reset()
+    {
+        Detach();
+        count = 0;
+        overflowed = false;
+    }
+
+    T& operator [] (uint32_t i) { return data[i]; }
+    const T& operator [] (uint32_t i) const { return data[i]; }
+};
 
-uint32_t CompileGLSLShaderFromFile(
-    const char* shader_file_path,
-    uint32_t shader_type
-)
+GeometryArena<Vertex> vertex_buffer(65536, 3*1048576);
+GeometryArena<TriInd> index_buffer(65536, 1048576);
+
+/* 同时为顶点与三角形分配空间，任意一个无法分配时两者都不分配 */
+bool AllocateGeometry(uint32_t vertices, uint32_t triangles, uint32_t& first_vertex, uint32_t& first_index)
 {
-    FILE* file = nullptr;
-#ifdef _WIN32
-    fopen_s(&file, shader_file_path, "rb");
+    if (!vertex_buffer.CanAllocate(vertices) || !index_buffer.CanAllocate(triangles))
+    {
+        std::cout << "Scene geometry overflow, dropping " << vertices << " vertices and " << triangles << " triangles" << std::endl;
+        return false;
+    }
+    first_vertex = vertex_buffer.Allocate(vertices);
+    first_index = index_buffer.Allocate(triangles);
+    return true;
+}
+
+/* 动态几何的上传方式：true 时直接写入持久映射的环形缓冲区，false 时只把脏区间通过 glNamedBufferSubData 上传 */
+const bool PERSISTENT_DYNAMIC_UPLOAD = true;
+
+/* 持久映射缓冲区的分区数，CPU 写入当前帧数据时 GPU 可以仍在读取前两帧的数据 */
+const int STREAM_BUFFER_REGIONS = 3;
+
+/*
+    使用 glNamedBufferStorage 创建的缓冲区。开头 static_size 字节存放只上传一次的静态数据，
+    其后是 regions 个大小相同的动态区域，每帧轮流写入其中一个。
+    持久映射时共有 STREAM_BUFFER_REGIONS 个区域，写入之前等待该区域上一次使用时插入的栅栏，
+    保证 GPU 已经不再读取；fence_waits 记录需要真正等待栅栏的次数，stall_ms 记录累计的等待时间。
+    不使用持久映射时只有一个区域，通过 glNamedBufferSubData 更新。
+*/
+struct StreamBuffer
+{
+    uint32_t buffer_object;
+    uint8_t* mapped;
+    const void* static_data;
+    uint64_t static_size;
+    uint64_t region_size;
+    int regions;
+    int region;
+    GLsync fences[STREAM_BUFFER_REGIONS];
+
+    uint64_t fence_waits;
+    double stall_ms;
+
+    void Create(const void* _static_data, uint64_t _static_size, uint64_t _region_size)
+    {
+        const uint32_t map_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        static_data = _static_data;
+        static_size = _static_size;
+        region_size = _region_size;
+        regions = PERSISTENT_DYNAMIC_UPLOAD ? STREAM_BUFFER_REGIONS : 1;
+        region = regions - 1;
+        for (int i = 0; i < STREAM_BUFFER_REGIONS; i++) fences[i] = nullptr;
+        glCreateBuffers(1, &buffer_object);
+        glNamedBufferStorage(buffer_object, static_size + region_size * regions, nullptr,
+            GL_DYNAMIC_STORAGE_BIT | (PERSISTENT_DYNAMIC_UPLOAD ? map_flags : 0));
+        if (static_size) glNamedBufferSubData(buffer_object, 0, static_size, static_data);
+        mapped = PERSISTENT_DYNAMIC_UPLOAD ?
+            (uint8_t*)glMapNamedBufferRange(buffer_object, 0, static_size + region_size * regions, map_flags) : nullptr;
+    }
+
+    void WaitRegion(int r)
+    {
+        if (!fences[r]) return;
+        GLenum result = glClientWaitSync(fences[r], 0, 0);
+        if (result == GL_TIMEOUT_EXPIRED)
+        {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            fence_waits++;
+            do result = glClientWaitSync(fences[r], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            while (result == GL_TIMEOUT_EXPIRED);
+            stall_ms += (std::chrono::steady_clock::now() - begin) / std::chrono::microseconds(1) * 0.001;
+        }
+        glDeleteSync(fences[r]);
+        fences[r] = nullptr;
+    }
+
+    /* 切换到下一个区域，持久映射时返回其映射地址 */
+    uint8_t* BeginRegion()
+    {
+        region = (region + 1) % regions;
+        WaitRegion(region);
+        return mapped ? mapped + RegionOffset() : nullptr;
+    }
+
+    /* 当前区域的绘制命令全部提交后调用 */
+    void EndRegion()
+    {
+        if (mapped) fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    uint64_t RegionOffset() const { return static_size + region * region_size; }
+
+    void Destroy()
+    {
+        for (int i = 0; i < STREAM_BUFFER_REGIONS; i++) WaitRegion(i);
+        if (mapped) glUnmapNamedBuffer(buffer_object);
+        glDeleteBuffers(1, &buffer_object);
+    }
+};
+
+StreamBuffer vertex_stream;
+StreamBuffer index_stream;
+
+/* 字节区间 [begin, end) */
+struct ByteRange
+{
+    uint64_t begin, end;
+};
+
+/* 记录被修改的字节区间，区间按升序加入，与上一个区间相邻或重叠时合并 */
+void AddDirtyRange(std::vector<ByteRange>& ranges, uint64_t begin, uint64_t end)
+{
+    if (!ranges.empty() && begin <= ranges.back().end)
+    {
+        if (end > ranges.back().end) ranges.back().end = end;
+        return;
+    }
+    ByteRange range;
+    range.begin = begin;
+    range.end = end;
+    ranges.push_back(range);
+}
+
+/* 静态批次中的一个物体，对应一条绘制命令 */
+struct StaticObject
+{
+    uint32_t first_index, triangle_count;
+    Vec3f color;
+    /* 包围球，由 InitStaticGeometry 根据物体的顶点计算 */
+    Vec3f center;
+    float radius;
+};
+
+/* 动态物体上一次生成时的参数与位置，用于判断本帧是否需要重新生成 */
+struct DynamicObject
+{
+    Vec3f origin;
+    float radius;
+    uint32_t first_vertex, first_index;
+    int64_t last_change_frame;
+    DynamicObject() { radius = -1.0f; first_vertex = first_index = UINT32_MAX; last_change_frame = 0; }
+};
+
+/*
+    静态与动态几何的管理。静态批次(房间)在 InitAssets 中生成并上传一次，位于顶点/索引缓冲区的开头；
+    动态批次(球)每帧在 LoadScene 中生成，位于其后的动态区域。
+    动态物体的参数与上一次相同、并且当前区域中保存的已经是最新数据时跳过生成，
+    实际写入的部分记录为脏区间，只有这些区间会被上传。
+*/
+struct GeometryManager
+{
+    std::vector<Vertex> static_vertices;
+    std::vector<TriInd> static_indices;
+    std::vector<StaticObject> static_objects;
+    std::vector<DynamicObject> dynamic_objects;
+    std::vector<ByteRange> vertex_dirty;
+    std::vector<ByteRange> index_dirty;
+    int64_t frame;
+    uint64_t uploaded_bytes;
+};
+
+GeometryManager geometry;
+
+/* 缓冲区被重新创建后，所有区域中的动态数据都需要重新生成 */
+void InvalidateDynamicGeometry()
+{
+    for (size_t i = 0; i < geometry.dynamic_objects.size(); i++)
+        geometry.dynamic_objects[i].first_vertex = UINT32_MAX;
+}
+
+/* 上传脏区间，持久映射时数据已经直接写入，只统计字节数 */
+uint64_t UploadDirtyRanges(const StreamBuffer& stream, const std::vector<ByteRange>& ranges, const void* data)
+{
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        if (!stream.mapped)
+            glNamedBufferSubData(stream.buffer_object, stream.RegionOffset() + ranges[i].begin, ranges[i].end - ranges[i].begin, (const uint8_t*)data + ranges[i].begin);
+        bytes += ranges[i].end - ranges[i].begin;
+    }
+    return bytes;
+}
+
+/*
+    记录当前绑定的 GL 状态，与当前状态相同的绑定调用会被跳过。
+    所有渲染循环中的绑定都需要经过这里，issued 与 elided 分别统计每帧实际发出与被跳过的调用数。
+*/
+struct GLStateCache
+{
+    static const int MAX_TEXTURE_UNITS = 8;
+    static const int MAX_BUFFER_BINDINGS = 8;
+
+    uint32_t program;
+    uint32_t vertex_array;
+    uint32_t framebuffer;
+    uint32_t draw_indirect_buffer;
+    uint32_t textures[MAX_TEXTURE_UNITS];
+    struct BufferRange { uint32_t buffer; uint64_t offset, size; } ssbo_ranges[MAX_BUFFER_BINDINGS], ubo_ranges[MAX_BUFFER_BINDINGS];
+
+    uint64_t issued;
+    uint64_t elided;
+
+    /* 之后的每个绑定都会被实际发出，在绕过缓存修改了 GL 状态之后调用 */
+    void Invalidate()
+    {
+        program = vertex_array = framebuffer = draw_indirect_buffer = UINT32_MAX;
+        for (int i = 0; i < MAX_TEXTURE_UNITS; i++) textures[i] = UINT32_MAX;
+        for (int i = 0; i < MAX_BUFFER_BINDINGS; i++) ssbo_ranges[i].buffer = ubo_ranges[i].buffer = UINT32_MAX;
+    }
+
+    bool Changed(uint32_t& current, uint32_t value)
+    {
+        if (current == value)
+        {
+            elided++;
+            return false;
+        }
+        current = value;
+        issued++;
+        return true;
+    }
+
+    void UseProgram(uint32_t value) { if (Changed(program, value)) glUseProgram(value); }
+    void BindVertexArray(uint32_t value) { if (Changed(vertex_array, value)) glBindVertexArray(value); }
+    void BindFramebuffer(uint32_t value) { if (Changed(framebuffer, value)) glBindFramebuffer(GL_FRAMEBUFFER, value); }
+    void BindDrawIndirectBuffer(uint32_t value) { if (Changed(draw_indirect_buffer, value)) glBindBuffer(GL_DRAW_INDIRECT_BUFFER, value); }
+    void BindTextureUnit(uint32_t unit, uint32_t value) { if (Changed(textures[unit], value)) glBindTextureUnit(unit, value); }
+
+    bool RangeChanged(BufferRange& range, uint32_t buffer, uint64_t offset, uint64_t size)
+    {
+        if (range.buffer == buffer && range.offset == offset && range.size == size)
+        {
+            elided++;
+            return false;
+        }
+        range.buffer = buffer;
+        range.offset = offset;
+        range.size = size;
+        issued++;
+        return true;
+    }
+
+    void BindShaderStorageRange(uint32_t index, uint32_t buffer, uint64_t offset, uint64_t size)
+    {
+        if (RangeChanged(ssbo_ranges[index], buffer, offset, size)) glBindBufferRange(GL_SHADER_STORAGE_BUFFER, index, buffer, offset, size);
+    }
+
+    void BindUniformRange(uint32_t index, uint32_t buffer, uint64_t offset, uint64_t size)
+    {
+        if (RangeChanged(ubo_ranges[index], buffer, offset, size)) glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+    }
+};
+
+GLStateCache gl_state;
+
+/* 顶点格式，每种格式对应一个顶点数组对象 */
+enum VertexLayout
+{
+    VERTEX_LAYOUT_POSITION,     /* 只有位置，用于深度图与自发光物体 */
+    VERTEX_LAYOUT_FULL,         /* 位置与法线 */
+    VERTEX_LAYOUT_COUNT
+};
+
+/*
+    每种顶点格式的顶点数组对象使用 DSA 函数创建一次。
+    流式缓冲区扩容后缓冲区对象会改变，此时只重新设置缓冲区绑定。
+    新缓冲区的名字可能与旧的相同，所以扩容时由 GrowStreamBuffer 调用 Invalidate。
+*/
+struct VertexArrayCache
+{
+    uint32_t vertex_arrays[VERTEX_LAYOUT_COUNT];
+    uint32_t vertex_buffer, index_buffer;
+    bool created;
+
+    uint32_t Get(VertexLayout layout)
+    {
+        if (!created)
+        {
+            glCreateVertexArrays(VERTEX_LAYOUT_COUNT, vertex_arrays);
+            for (int i = 0; i < VERTEX_LAYOUT_COUNT; i++)
+            {
+                glEnableVertexArrayAttrib(vertex_arrays[i], 0);
+                glVertexArrayAttribFormat(vertex_arrays[i], 0, 3, GL_FLOAT, false, offsetof(Vertex, pos));
+                glVertexArrayAttribBinding(vertex_arrays[i], 0, 0);
+            }
+            glEnableVertexArrayAttrib(vertex_arrays[VERTEX_LAYOUT_FULL], 1);
+            glVertexArrayAttribFormat(vertex_arrays[VERTEX_LAYOUT_FULL], 1, 3, GL_FLOAT, false, offsetof(Vertex, normal));
+            glVertexArrayAttribBinding(vertex_arrays[VERTEX_LAYOUT_FULL], 1, 0);
+            vertex_buffer = index_buffer = 0;
+            created = true;
+        }
+        if (vertex_buffer != vertex_stream.buffer_object || index_buffer != index_stream.buffer_object)
+        {
+            vertex_buffer = vertex_stream.buffer_object;
+            index_buffer = index_stream.buffer_object;
+            for (int i = 0; i < VERTEX_LAYOUT_COUNT; i++)
+            {
+                glVertexArrayVertexBuffer(vertex_arrays[i], 0, vertex_buffer, 0, sizeof(Vertex));
+                glVertexArrayElementBuffer(vertex_arrays[i], index_buffer);
+            }
+        }
+        return vertex_arrays[layout];
+    }
+
+    /* 缓冲区重新创建后调用，下次 Get 时重新设置缓冲区绑定 */
+    void Invalidate() { vertex_buffer = index_buffer = 0; }
+};
+
+VertexArrayCache vertex_array_cache;
+
+/* 区域容量不足时按两倍方式扩大，required_count 为需要容纳的元素个数 */
+void GrowStreamBuffer(StreamBuffer& stream, uint64_t element_size, uint64_t required_count, const char* name)
+{
+    uint64_t count = stream.region_size / element_size;
+    if (required_count <= count) return;
+    while (count < required_count) count *= 2;
+    stream.Destroy();
+    stream.Create(stream.static_data, stream.static_size, count * element_size);
+    /* 新缓冲区可能复用刚删除的名字，缓存中按名字比较的绑定都要重新发出 */
+    gl_state.Invalidate();
+    vertex_array_cache.Invalidate();
+    std::cout << name << " grown to " << (count * element_size >> 10) << "KB x " << stream.regions << std::endl;
+}
+
+/* 与 glMultiDrawElementsIndirect 要求的命令格式一致 */
+struct DrawElementsIndirectCommand
+{
+    uint32_t count;
+    uint32_t instance_count;
+    uint32_t first_index;
+    int32_t base_vertex;
+    uint32_t base_instance;
+};
+
+/* 每条绘制命令对应的物体数据，布局与着色器中的 DrawData (std430) 一致，着色器通过 gl_DrawID 索引 */
+struct DrawData
+{
+    Vec3f color;
+    float padding;
+};
+
+/* 一次 glMultiDrawElementsIndirect 提交的绘制命令及对应的物体数据 */
+struct DrawCommandList
+{
+    std::vector<DrawElementsIndirectCommand> commands;
+    std::vector<DrawData> draw_data;
+    /* 本帧上传后在间接绘制缓冲区与物体数据缓冲区中的字节偏移 */
+    uint64_t command_offset;
+    uint64_t draw_data_offset;
+
+    void Clear()
+    {
+        commands.clear();
+        draw_data.clear();
+    }
+
+    void Add(uint32_t index_count, uint32_t first_index, int32_t base_vertex, Vec3f color)
+    {
+        DrawElementsIndirectCommand command;
+        command.count = index_count;
+        command.instance_count = 1;
+        command.first_index = first_index;
+        command.base_vertex = base_vertex;
+        command.base_instance = 0;
+        commands.push_back(command);
+        DrawData data;
+        data.color = color;
+        data.padding = 0.0f;
+        draw_data.push_back(data);
+    }
+};
+
+StreamBuffer indirect_stream;
+StreamBuffer draw_data_stream;
+
+/* 物体数据以 glBindBufferRange 绑定，每个列表的起始偏移需要满足 SSBO 的对齐要求，启动时由 InitBufferAlignments 查询 */
+uint64_t draw_data_alignment = 256;
+
+uint64_t AlignUp(uint64_t value, uint64_t alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+/* 把若干绘制命令列表写入各自流式缓冲区的当前区域，并记录每个列表的偏移 */
+void UploadDrawCommandLists(DrawCommandList** lists, int list_count)
+{
+    uint64_t command_bytes = 0, draw_data_bytes = 0;
+    for (int i = 0; i < list_count; i++)
+    {
+        lists[i]->command_offset = command_bytes;
+        lists[i]->draw_data_offset = draw_data_bytes;
+        command_bytes += sizeof(DrawElementsIndirectCommand) * lists[i]->commands.size();
+        draw_data_bytes += AlignUp(sizeof(DrawData) * lists[i]->draw_data.size(), draw_data_alignment);
+    }
+    GrowStreamBuffer(indirect_stream, 1, command_bytes, "Indirect command buffer");
+    GrowStreamBuffer(draw_data_stream, 1, draw_data_bytes, "Draw data buffer");
+
+    uint8_t* command_region = indirect_stream.BeginRegion();
+    uint8_t* draw_data_region = draw_data_stream.BeginRegion();
+    for (int i = 0; i < list_count; i++)
+    {
+        uint64_t command_size = sizeof(DrawElementsIndirectCommand) * lists[i]->commands.size();
+        uint64_t draw_data_size = sizeof(DrawData) * lists[i]->draw_data.size();
+        if (!command_size) continue;
+        if (command_region)
+        {
+            memcpy(command_region + lists[i]->command_offset, lists[i]->commands.data(), command_size);
+            memcpy(draw_data_region + lists[i]->draw_data_offset, lists[i]->draw_data.data(), draw_data_size);
+        }
+        else
+        {
+            glNamedBufferSubData(indirect_stream.buffer_object, indirect_stream.RegionOffset() + lists[i]->command_offset, command_size, lists[i]->commands.data());
+            glNamedBufferSubData(draw_data_stream.buffer_object, draw_data_stream.RegionOffset() + lists[i]->draw_data_offset, draw_data_size, lists[i]->draw_data.data());
+        }
+    }
+}
+
+/* 用一次 glMultiDrawElementsIndirect 提交整个列表，需要事先绑定间接绘制缓冲区 */
+void SubmitDrawCommandList(const DrawCommandList& list)
+{
+    if (list.commands.empty()) return;
+    gl_state.BindShaderStorageRange(0, draw_data_stream.buffer_object,
+        draw_data_stream.RegionOffset() + list.draw_data_offset, sizeof(DrawData) * list.draw_data.size());
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+        (void*)(indirect_stream.RegionOffset() + list.command_offset), list.commands.size(), 0);
+}
+
+/*
+    视锥体的 6 个平面 (a, b, c, d)，法向量已归一化并指向视锥体内部，
+    点 p 到平面的有向距离为 a * p.x + b * p.y + c * p.z + d。
+*/
+struct Frustum
+{
+    float planes[6][4];
+};
+
+/*
+    从 mat_proj * mat_trans 这样的裁剪变换中提取视锥平面。
+    着色器中的 mat * v 对应数学上矩阵的第 r 行为 (m[0][r], m[1][r], m[2][r], m[3][r])，
+    按 OpenGL 的裁剪范围 -w <= x, y, z <= w 得到 w ± x、w ± y、w ± z 六个平面。
+*/
+Frustum ExtractFrustum(const Matrix& mat)
+{
+    Frustum frustum;
+    for (int i = 0; i < 6; i++)
+    {
+        int axis = i >> 1;
+        float sign = (i & 1) ? -1.0f : 1.0f;
+        for (int j = 0; j < 4; j++)
+            frustum.planes[i][j] = mat.m[j][3] + sign * mat.m[j][axis];
+        float norm = length(Vec3f(frustum.planes[i][0], frustum.planes[i][1], frustum.planes[i][2]));
+        for (int j = 0; j < 4; j++)
+            frustum.planes[i][j] /= norm;
+    }
+    return frustum;
+}
+
+/* 参与剔除的所有物体的包围球，按 SoA 方式存放，数组长度补齐到 8 的倍数 */
+struct BoundingSphereSet
+{
+    std::vector<float> x, y, z, radius;
+    uint32_t count = 0;
+
+    void Clear()
+    {
+        x.clear(); y.clear(); z.clear(); radius.clear();
+        count = 0;
+    }
+
+    void Add(Vec3f center, float r)
+    {
+        x.push_back(center.x);
+        y.push_back(center.y);
+        z.push_back(center.z);
+        radius.push_back(r);
+        count++;
+    }
+
+    /* 补齐的包围球半径为负无穷，任何平面测试都不会通过 */
+    void Pad()
+    {
+        while (x.size() & 7)
+        {
+            x.push_back(0.0f); y.push_back(0.0f); z.push_back(0.0f);
+            radius.push_back(-INFINITY);
+        }
+    }
+};
+
+/*
+    用视锥的 6 个平面测试包围球，球心到任一平面的有向距离小于 -radius 时剔除，
+    可见物体的编号按顺序写入 visible。每次迭代测试 8 个包围球：
+    支持 AVX 时使用一个 256 位寄存器，否则使用两个 128 位 SSE 寄存器，都不支持时逐个测试。
+*/
+void CullBoundingSpheres(const BoundingSphereSet& spheres, const Frustum& frustum, std::vector<uint32_t>& visible)
+{
+    visible.clear();
+    for (uint32_t i = 0; i < spheres.count; i += 8)
+    {
+        uint32_t mask = 0;
+#if defined(__AVX__)
+        __m256 x = _mm256_loadu_ps(&spheres.x[i]);
+        __m256 y = _mm256_loadu_ps(&spheres.y[i]);
+        __m256 z = _mm256_loadu_ps(&spheres.z[i]);
+        __m256 neg_radius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&spheres.radius[i]));
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; p++)
+        {
+            const float* plane = frustum.planes[p];
+            __m256 distance = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(plane[0])), _mm256_mul_ps(y, _mm256_set1_ps(plane[1]))),
+                _mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(plane[2])), _mm256_set1_ps(plane[3])));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, neg_radius, _CMP_GE_OQ));
+        }
+        mask = _mm256_movemask_ps(inside);
+#elif defined(CULLING_SSE)
+        for (int half = 0; half < 2; half++)
+        {
+            uint32_t base = i + half * 4;
+            __m128 x = _mm_loadu_ps(&spheres.x[base]);
+            __m128 y = _mm_loadu_ps(&spheres.y[base]);
+            __m128 z = _mm_loadu_ps(&spheres.z[base]);
+            __m128 neg_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[base]));
+            __m128 inside = _mm_cmpeq_ps(x, x);
+            for (int p = 0; p < 6; p++)
+            {
+                const float* plane = frustum.planes[p];
+                __m128 distance = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane[0])), _mm_mul_ps(y, _mm_set1_ps(plane[1]))),
+                    _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane[2])), _mm_set1_ps(plane[3])));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, neg_radius));
+            }
+            mask |= _mm_movemask_ps(inside) << (half * 4);
+        }
 #else
-    file = fopen(shader_file_path, "rb");
+        for (uint32_t k = 0; k < 8; k++)
+        {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; p++)
+            {
+                const float* plane = frustum.planes[p];
+                float distance = spheres.x[i + k] * plane[0] + spheres.y[i + k] * plane[1] + spheres.z[i + k] * plane[2] + plane[3];
+                inside = distance >= -spheres.radius[i + k];
+            }
+            if (inside) mask |= 1u << k;
+        }
 #endif
-    if (!file) return 0;
-    fseek(file, 0, SEEK_END);
-    int64_t length = ftell(file);
-    char* source_code = new char[length + 1];
-    memset(source_code, 0, length + 1);
-    fseek(file, 0, SEEK_SET);
-    fread(source_code, 1, length, file);
-    fclose(file);
+        while (mask)
+        {
+            uint32_t k = 0;
+            while (!(mask & (1u << k))) k++;
+            mask &= mask - 1;
+            if (i + k < spheres.count) visible.push_back(i + k);
+        }
+    }
+}
 
-    uint32_t shader_object = glCreateShader(shader_type);
-    glShaderSource(shader_object, 1, &source_code, nullptr);
-    delete[] source_code;
-    glCompileShader(shader_object);
+/*
+    软件光栅化的遮挡剔除。把墙面与每个球的内接低面数多面体光栅化到一张低分辨率深度图中，
+    再生成逐级取最小值与最大值的深度金字塔，物体包围盒的最近深度比所覆盖区域的最大深度还远时即被遮挡。
+    光栅化只采样像素中心，因此最大深度的第 0 层取 3x3 邻域的最大值，只有被遮挡物完全覆盖的像素才会遮挡物体。
+    深度与 OpenGL 相同，取归一化设备坐标中的 z，越小越近。
+*/
+const bool OCCLUSION_CULLING = true;
+const uint32_t OCCLUSION_WIDTH = 256;
+const uint32_t OCCLUSION_HEIGHT = 128;
+const uint32_t OCCLUSION_LEVELS = 8;
+/* 深度图按行分为若干条带，由线程池并行光栅化 */
+const uint32_t OCCLUSION_BAND_HEIGHT = 8;
+/* 作为遮挡物的球的内接多面体精度，顶点都在球面上，因此整个多面体都在球内 */
+const int OCCLUDER_SPHERE_SLICES = 8;
+const int OCCLUDER_SPHERE_STACKS = 4;
+const int OCCLUDER_SPHERE_TRIANGLES = OCCLUDER_SPHERE_SLICES * 2 * (OCCLUDER_SPHERE_STACKS - 1);
+
+/* 屏幕空间中逆时针顺序的三角形，min_y > max_y 表示三角形已被舍弃 */
+struct ScreenTriangle
+{
+    float x[3], y[3], z[3];
+    float min_x, max_x, min_y, max_y;
+};
 
-    int32_t compilation_success;
-    glGetShaderiv(shader_object, GL_COMPILE_STATUS, &compilation_success);
-    if (!compilation_success)
+void TransformClip(const Matrix& mat, Vec3f p, float clip[4])
+{
+    for (int r = 0; r < 4; r++)
+        clip[r] = p.x * mat.m[0][r] + p.y * mat.m[1][r] + p.z * mat.m[2][r] + mat.m[3][r];
+}
+
+struct OcclusionBuffer
+{
+    uint32_t level_width[OCCLUSION_LEVELS], level_height[OCCLUSION_LEVELS];
+    /* 第 0 层的最小值是光栅化得到的深度，最大值是其 3x3 邻域的最大值 */
+    std::vector<float> min_depth[OCCLUSION_LEVELS], max_depth[OCCLUSION_LEVELS];
+    std::vector<ScreenTriangle> triangles;
+    std::vector<Vec3f> sphere_vertices;
+    std::vector<TriInd> sphere_triangles;
+    /* 本帧被遮挡剔除的物体数 */
+    uint32_t occluded = 0;
+
+    /* 先在浮点数中限制到 [-1, limit] 再转换为整数，w 接近 0 时屏幕坐标可能超出 int 的范围 */
+    static int ToPixel(float value, int limit) { return (int)std::min((float)limit, std::max(-1.0f, value)); }
+
+    void Init()
     {
-        int32_t log_length;
-        glGetShaderiv(shader_object, GL_INFO_LOG_LENGTH, &log_length);
-        char* error_info = new char[log_length + 1];
-        glGetShaderInfoLog(shader_object, log_length + 1, &log_length, error_info);
-        std::cout << error_info << std::endl;
-        glDeleteShader(shader_object);
-        return 0;
+        for (uint32_t level = 0; level < OCCLUSION_LEVELS; level++)
+        {
+            level_width[level] = std::max(1u, OCCLUSION_WIDTH >> level);
+            level_height[level] = std::max(1u, OCCLUSION_HEIGHT >> level);
+            min_depth[level].resize(level_width[level] * level_height[level]);
+            max_depth[level].resize(level_width[level] * level_height[level]);
+        }
+
+        sphere_vertices.clear();
+        sphere_triangles.clear();
+        sphere_vertices.push_back(Vec3f(0.0f, 0.0f, 1.0f));
+        sphere_vertices.push_back(Vec3f(0.0f, 0.0f, -1.0f));
+        for (int i = 1; i < OCCLUDER_SPHERE_STACKS; i++)
+        {
+            float y = i * (1.0f / OCCLUDER_SPHERE_STACKS) * pi;
+            for (int j = 0; j < OCCLUDER_SPHERE_SLICES; j++)
+            {
+                float x = j * (2.0f / OCCLUDER_SPHERE_SLICES) * pi;
+                sphere_vertices.push_back(Vec3f(sin(y) * sin(x), sin(y) * cos(x), cos(y)));
+            }
+        }
+        for (int j = 0; j < OCCLUDER_SPHERE_SLICES; j++)
+        {
+            uint32_t j1 = (j + 1) % OCCLUDER_SPHERE_SLICES;
+            uint32_t last = 2 + (OCCLUDER_SPHERE_STACKS - 2) * OCCLUDER_SPHERE_SLICES;
+            sphere_triangles.push_back(TriInd(0, 2 + j, 2 + j1));
+            sphere_triangles.push_back(TriInd(1, last + j1, last + j));
+            for (int i = 0; i < OCCLUDER_SPHERE_STACKS - 2; i++)
+            {
+                uint32_t a = 2 + i * OCCLUDER_SPHERE_SLICES;
+                uint32_t b = a + OCCLUDER_SPHERE_SLICES;
+                sphere_triangles.push_back(TriInd(a + j, b + j, b + j1));
+                sphere_triangles.push_back(TriInd(a + j, b + j1, a + j1));
+            }
+        }
+    }
+
+    /*
+        把裁剪空间中的三角形变换到屏幕空间。跨过近平面的三角形直接舍弃，
+        这只会减少遮挡物，不会导致错误的剔除。cull_back 为真时舍弃背面(顺时针)的三角形。
+    */
+    bool SetupTriangle(const float clip[3][4], bool cull_back, ScreenTriangle& triangle) const
+    {
+        triangle.min_y = 1.0f;
+        triangle.max_y = 0.0f;
+        for (int i = 0; i < 3; i++)
+        {
+            if (clip[i][3] <= 0.0f || clip[i][2] < -clip[i][3]) return false;
+            float inv_w = 1.0f / clip[i][3];
+            triangle.x[i] = (clip[i][0] * inv_w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+            triangle.y[i] = (clip[i][1] * inv_w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+            triangle.z[i] = clip[i][2] * inv_w;
+        }
+        float area = (triangle.x[1] - triangle.x[0]) * (triangle.y[2] - triangle.y[0]) -
+            (triangle.x[2] - triangle.x[0]) * (triangle.y[1] - triangle.y[0]);
+        if (area == 0.0f || (cull_back && area < 0.0f)) return false;
+        if (area < 0.0f)
+        {
+            std::swap(triangle.x[1], triangle.x[2]);
+            std::swap(triangle.y[1], triangle.y[2]);
+            std::swap(triangle.z[1], triangle.z[2]);
+        }
+        triangle.min_x = std::min(triangle.x[0], std::min(triangle.x[1], triangle.x[2]));
+        triangle.max_x = std::max(triangle.x[0], std::max(triangle.x[1], triangle.x[2]));
+        float min_y = std::min(triangle.y[0], std::min(triangle.y[1], triangle.y[2]));
+        float max_y = std::max(triangle.y[0], std::max(triangle.y[1], triangle.y[2]));
+        if (triangle.max_x < 0.0f || triangle.min_x > OCCLUSION_WIDTH || max_y < 0.0f || min_y > OCCLUSION_HEIGHT) return false;
+        triangle.min_y = min_y;
+        triangle.max_y = max_y;
+        return true;
+    }
+
+    /*
+        光栅化 [row_begin, row_end) 行内的所有三角形，像素中心在三角形内时写入较小的深度。
+        每次处理一行中相邻的 4 个像素。
+    */
+    void RasterizeBand(uint32_t row_begin, uint32_t row_end)
+    {
+        float* depth = min_depth[0].data();
+        for (uint32_t y = row_begin; y < row_end; y++)
+            std::fill(depth + y * OCCLUSION_WIDTH, depth + (y + 1) * OCCLUSION_WIDTH, 1.0f);
+
+        for (size_t t = 0; t < triangles.size(); t++)
+        {
+            const ScreenTriangle& tri = triangles[t];
+            if (tri.max_y < row_begin || tri.min_y > row_end) continue;
+
+            float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+            float edge_a[3], edge_b[3], edge_c[3];
+            for (int i = 0; i < 3; i++)
+            {
+                int j = (i + 1) % 3;
+                edge_a[i] = tri.y[i] - tri.y[j];
+                edge_b[i] = tri.x[j] - tri.x[i];
+                edge_c[i] = -(edge_a[i] * tri.x[i] + edge_b[i] * tri.y[i]);
+            }
+            float dzdx = ((tri.z[1] - tri.z[0]) * (tri.y[2] - tri.y[0]) - (tri.z[2] - tri.z[0]) * (tri.y[1] - tri.y[0])) / area;
+            float dzdy = ((tri.z[2] - tri.z[0]) * (tri.x[1] - tri.x[0]) - (tri.z[1] - tri.z[0]) * (tri.x[2] - tri.x[0])) / area;
+            float z_bias = tri.z[0] - dzdx * tri.x[0] - dzdy * tri.y[0];
+            float z_max = std::max(tri.z[0], std::max(tri.z[1], tri.z[2]));
+
+            int y0 = std::max((int)row_begin, ToPixel(floorf(tri.min_y), OCCLUSION_HEIGHT));
+            int y1 = std::min((int)row_end - 1, ToPixel(ceilf(tri.max_y), OCCLUSION_HEIGHT));
+            int x0 = std::max(0, ToPixel(floorf(tri.min_x), OCCLUSION_WIDTH)) & ~3;
+            int x1 = std::min((int)OCCLUSION_WIDTH - 1, ToPixel(ceilf(tri.max_x), OCCLUSION_WIDTH));
+            for (int y = y0; y <= y1; y++)
+            {
+                float py = y + 0.5f;
+                float* row = depth + y * OCCLUSION_WIDTH;
+#ifdef CULLING_SSE
+                __m128 step = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+                __m128 edge_row[3], edge_step[3];
+                for (int i = 0; i < 3; i++)
+                {
+                    edge_row[i] = _mm_set1_ps(edge_b[i] * py + edge_c[i]);
+                    edge_step[i] = _mm_set1_ps(edge_a[i]);
+                }
+                __m128 z_row = _mm_set1_ps(dzdy * py + z_bias);
+                __m128 z_step = _mm_set1_ps(dzdx);
+                __m128 z_clamp = _mm_set1_ps(z_max);
+                __m128 zero = _mm_setzero_ps();
+                for (int x = x0; x <= x1; x += 4)
+                {
+                    __m128 px = _mm_add_ps(_mm_set1_ps((float)x), step);
+                    __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edge_step[0], px), edge_row[0]), zero);
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edge_step[1], px), edge_row[1]), zero));
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edge_step[2], px), edge_row[2]), zero));
+                    if (!_mm_movemask_ps(inside)) continue;
+                    __m128 z = _mm_min_ps(_mm_add_ps(_mm_mul_ps(z_step, px), z_row), z_clamp);
+                    __m128 old_depth = _mm_loadu_ps(row + x);
+                    __m128 new_depth = _mm_min_ps(old_depth, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, new_depth), _mm_andnot_ps(inside, old_depth)));
+                }
+#else
+                for (int x = x0; x <= x1; x++)
+                {
+                    float px = x + 0.5f;
+                    bool inside = true;
+                    for (int i = 0; i < 3; i++)
+                        inside = inside && edge_a[i] * px + edge_b[i] * py + edge_c[i] >= 0.0f;
+                    if (inside) row[x] = std::min(row[x], std::min(dzdx * px + dzdy * py + z_bias, z_max));
+                }
+#endif
+            }
+        }
+    }
+
+    /* 最大深度第 0 层的 [row_begin, row_end) 行取光栅化深度 3x3 邻域的最大值，图像外视为最远 */
+    void DilateBand(uint32_t row_begin, uint32_t row_end)
+    {
+        const float* depth = min_depth[0].data();
+        float column_max[OCCLUSION_WIDTH + 2];
+        column_max[0] = column_max[OCCLUSION_WIDTH + 1] = 1.0f;
+        for (uint32_t y = row_begin; y < row_end; y++)
+        {
+            const float* row = depth + y * OCCLUSION_WIDTH;
+            const float* above = (y + 1 < OCCLUSION_HEIGHT) ? row + OCCLUSION_WIDTH : nullptr;
+            const float* below = (y > 0) ? row - OCCLUSION_WIDTH : nullptr;
+            float* dst = max_depth[0].data() + y * OCCLUSION_WIDTH;
+            if (!above || !below)
+            {
+                std::fill(dst, dst + OCCLUSION_WIDTH, 1.0f);
+                continue;
+            }
+            uint32_t x = 0;
+#ifdef CULLING_SSE
+            for (; x < OCCLUSION_WIDTH; x += 4)
+                _mm_storeu_ps(column_max + 1 + x, _mm_max_ps(_mm_loadu_ps(row + x),
+                    _mm_max_ps(_mm_loadu_ps(above + x), _mm_loadu_ps(below + x))));
+            for (x = 0; x < OCCLUSION_WIDTH; x += 4)
+                _mm_storeu_ps(dst + x, _mm_max_ps(_mm_loadu_ps(column_max + 1 + x),
+                    _mm_max_ps(_mm_loadu_ps(column_max + x), _mm_loadu_ps(column_max + 2 + x))));
+#else
+            for (; x < OCCLUSION_WIDTH; x++)
+                column_max[1 + x] = std::max(row[x], std::max(above[x], below[x]));
+            for (x = 0; x < OCCLUSION_WIDTH; x++)
+                dst[x] = std::max(column_max[1 + x], std::max(column_max[x], column_max[2 + x]));
+#endif
+        }
+    }
+
+    /* 每个上层像素取下层 2x2 像素的最小值与最大值 */
+    void BuildPyramid()
+    {
+        for (uint32_t level = 1; level < OCCLUSION_LEVELS; level++)
+        {
+            uint32_t width = level_width[level], src_width = level_width[level - 1];
+            for (int k = 0; k < 2; k++)
+            {
+                const float* src = (k ? max_depth : min_depth)[level - 1].data();
+                float* dst = (k ? max_depth : min_depth)[level].data();
+                for (uint32_t y = 0; y < level_height[level]; y++)
+                {
+                    const float* row0 = src + (2 * y) * src_width;
+                    const float* row1 = row0 + src_width;
+                    uint32_t x = 0;
+#ifdef CULLING_SSE
+                    for (; x + 4 <= width; x += 4)
+                    {
+                        __m128 a0 = _mm_loadu_ps(row0 + 2 * x), a1 = _mm_loadu_ps(row0 + 2 * x + 4);
+                        __m128 b0 = _mm_loadu_ps(row1 + 2 * x), b1 = _mm_loadu_ps(row1 + 2 * x + 4);
+                        __m128 v0 = k ? _mm_max_ps(a0, b0) : _mm_min_ps(a0, b0);
+                        __m128 v1 = k ? _mm_max_ps(a1, b1) : _mm_min_ps(a1, b1);
+                        __m128 even = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0));
+                        __m128 odd = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1));
+                        _mm_storeu_ps(dst + y * width + x, k ? _mm_max_ps(even, odd) : _mm_min_ps(even, odd));
+                    }
+#endif
+                    for (; x < width; x++)
+                    {
+                        float a = row0[2 * x], b = row0[2 * x + 1], c = row1[2 * x], d = row1[2 * x + 1];
+                        dst[y * width + x] = k ? std::max(std::max(a, b), std::max(c, d)) : std::min(std::min(a, b), std::min(c, d));
+                    }
+                }
+            }
+        }
+    }
+
+    /* 光栅化 triangles 中的所有遮挡物并生成深度金字塔 */
+    void Render()
+    {
+        uint32_t bands = OCCLUSION_HEIGHT / OCCLUSION_BAND_HEIGHT;
+        thread_pool.ParallelFor(bands, 1, [&](uint32_t begin, uint32_t end)
+        {
+            for (uint32_t band = begin; band < end; band++)
+                RasterizeBand(band * OCCLUSION_BAND_HEIGHT, (band + 1) * OCCLUSION_BAND_HEIGHT);
+        });
+        thread_pool.ParallelFor(bands, 1, [&](uint32_t begin, uint32_t end)
+        {
+            for (uint32_t band = begin; band < end; band++)
+                DilateBand(band * OCCLUSION_BAND_HEIGHT, (band + 1) * OCCLUSION_BAND_HEIGHT);
+        });
+        BuildPyramid();
+    }
+
+    /*
+        从较粗的层级开始检查像素矩形 [x0, x1] x [y0, y1]：最近深度比某个像素的最大深度远时该像素被遮挡；
+        不比该像素的最小深度远时一定不被遮挡；否则进入下一层的 2x2 像素继续检查。
+    */
+    bool RegionOccluded(uint32_t level, int x0, int y0, int x1, int y1, int tx0, int ty0, int tx1, int ty1, float z) const
+    {
+        int shift = level;
+        tx0 = std::max(tx0, x0 >> shift);
+        ty0 = std::max(ty0, y0 >> shift);
+        tx1 = std::min(tx1, x1 >> shift);
+        ty1 = std::min(ty1, y1 >> shift);
+        for (int ty = ty0; ty <= ty1; ty++)
+            for (int tx = tx0; tx <= tx1; tx++)
+            {
+                uint32_t i = ty * level_width[level] + tx;
+                if (z > max_depth[level][i]) continue;
+                if (level == 0 || z <= min_depth[level][i]) return false;
+                if (!RegionOccluded(level - 1, x0, y0, x1, y1, tx * 2, ty * 2, tx * 2 + 1, ty * 2 + 1, z)) return false;
+            }
+        return true;
+    }
+
+    /* 判断轴对齐包围盒是否被遮挡，包围盒跨过近平面时视为可见 */
+    bool IsOccluded(Vec3f lower, Vec3f upper, const Matrix& mat) const
+    {
+        float min_x = INFINITY, max_x = -INFINITY, min_y = INFINITY, max_y = -INFINITY, min_z = INFINITY;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            Vec3f p((corner & 1) ? upper.x : lower.x, (corner & 2) ? upper.y : lower.y, (corner & 4) ? upper.z : lower.z);
+            float clip[4];
+            TransformClip(mat, p, clip);
+            if (clip[3] <= 0.0f || clip[2] < -clip[3]) return false;
+            float inv_w = 1.0f / clip[3];
+            float x = (clip[0] * inv_w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+            float y = (clip[1] * inv_w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+            min_x = std::min(min_x, x); max_x = std::max(max_x, x);
+            min_y = std::min(min_y, y); max_y = std::max(max_y, y);
+            min_z = std::min(min_z, clip[2] * inv_w);
+        }
+        int x0 = std::max(0, ToPixel(floorf(min_x), OCCLUSION_WIDTH)), x1 = std::min((int)OCCLUSION_WIDTH - 1, ToPixel(floorf(max_x), OCCLUSION_WIDTH));
+        int y0 = std::max(0, ToPixel(floorf(min_y), OCCLUSION_HEIGHT)), y1 = std::min((int)OCCLUSION_HEIGHT - 1, ToPixel(floorf(max_y), OCCLUSION_HEIGHT));
+        if (x0 > x1 || y0 > y1) return false;
+        uint32_t level = 0;
+        while (level + 1 < OCCLUSION_LEVELS && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+            level++;
+        return RegionOccluded(level, x0, y0, x1, y1, 0, 0, INT32_MAX, INT32_MAX, min_z);
+    }
+};
+
+OcclusionBuffer occlusion_buffer;
+
+
+uint32_t depth_map_object;
+uint32_t depth_map_framebuffer_object;
+uint32_t depth_shader_program_object;
+int32_t depth_mat_trans_location;
+
+/*
+    级联阴影图：相机视锥按距离分为若干段，每段使用一个正交投影的级联，
+    所有级联并排放在同一张深度图集中，每个级联的分辨率可以单独设置。
+*/
+const int MAX_SHADOW_CASCADES = 4;
+const int SHADOW_CASCADE_COUNT = 4;
+const uint32_t SHADOW_CASCADE_SIZE[MAX_SHADOW_CASCADES] = { 1024, 1024, 1024, 1024 };
+/* 阴影覆盖的最远距离，以及分割距离中对数分割所占的比例 */
+const float SHADOW_DISTANCE = 40.0f;
+const float SHADOW_SPLIT_LAMBDA = 0.75f;
+/* 级联范围之外、位于光源一侧的投影物最远的距离 */
+const float SHADOW_CASTER_DISTANCE = 30.0f;
+
+struct ShadowCascade
+{
+    Matrix mat;
+    /* 级联覆盖的最远视点距离 */
+    float far_distance;
+    /* 深度范围与一个像素的宽度(世界空间)，用于估计半影宽度 */
+    float depth_range, texel_size;
+    /* 级联在深度图集中的位置 */
+    uint32_t offset_x, size;
+};
+
+ShadowCascade shadow_cascades[MAX_SHADOW_CASCADES];
+uint32_t shadow_atlas_width, shadow_atlas_height;
+/* 运行时降低阴影分辨率：每个级联的实际分辨率为 SHADOW_CASCADE_SIZE 右移该值，最小为 64 */
+uint32_t shadow_resolution_shift = 0;
+
+void InitShadowAtlasLayout()
+{
+    shadow_atlas_width = shadow_atlas_height = 0;
+    for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
+    {
+        uint32_t size = std::max(64u, SHADOW_CASCADE_SIZE[c] >> shadow_resolution_shift);
+        shadow_cascades[c].offset_x = shadow_atlas_width;
+        shadow_cascades[c].size = size;
+        shadow_atlas_width += size;
+        shadow_atlas_height = std::max(shadow_atlas_height, size);
+    }
+    std::cout << "Shadow atlas: " << shadow_atlas_width << "x" << shadow_atlas_height << ", " << SHADOW_CASCADE_COUNT
+        << " cascades, " << shadow_atlas_width * shadow_atlas_height * sizeof(float) / 1048576.0 << "MB" << std::endl;
+}
+
+/*
+    让每个级联的正交投影包住相机视锥中对应的一段。包围球的半径取整，球心在光源空间中按级联的像素大小对齐，
+    相机移动时阴影边缘不会闪烁，相机静止时矩阵保持不变。
+*/
+void FitShadowCascades(Vec3f light_direction, const Matrix& camera_to_world, float near, float aspect, float fov)
+{
+    Matrix light_rotation = fake_inverse(LookAtMatrix(Vec3f(0.0f, 0.0f, 0.0f), light_direction));
+    float tan_y = tan(fov * 0.5f), tan_x = tan_y * aspect;
+    float split_near = near;
+    for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
+    {
+        ShadowCascade& cascade = shadow_cascades[c];
+        float t = (c + 1) / (float)SHADOW_CASCADE_COUNT;
+        float split_far = SHADOW_SPLIT_LAMBDA * near * pow(SHADOW_DISTANCE / near, t) +
+            (1.0f - SHADOW_SPLIT_LAMBDA) * (near + (SHADOW_DISTANCE - near) * t);
+
+        Vec3f corners[8], center;
+        for (int k = 0; k < 8; k++)
+        {
+            float d = (k & 4) ? split_far : split_near;
+            float world[4];
+            TransformClip(camera_to_world, Vec3f((k & 1) ? tan_x * d : -tan_x * d, (k & 2) ? tan_y * d : -tan_y * d, d), world);
+            corners[k] = Vec3f(world[0], world[1], world[2]);
+            center = center + corners[k] * 0.125f;
+        }
+        float radius = 0.0f;
+        for (int k = 0; k < 8; k++)
+            radius = std::max(radius, length(corners[k] - center));
+        radius = ceil(radius * 16.0f) / 16.0f;
+
+        float texel = 2.0f * radius / cascade.size;
+        Vec3f light_center = light_rotation * center;
+        light_center = Vec3f(floor(light_center.x / texel) * texel, floor(light_center.y / texel) * texel, floor(light_center.z / texel) * texel);
+        float z_near = light_center.z - radius - SHADOW_CASTER_DISTANCE, z_far = light_center.z + radius;
+        cascade.mat = Matrix(
+            1.0f / radius, 0.0f, 0.0f, 0.0f,
+            0.0f, 1.0f / radius, 0.0f, 0.0f,
+            0.0f, 0.0f, 2.0f / (z_far - z_near), 0.0f,
+            -light_center.x / radius, -light_center.y / radius, -(z_far + z_near) / (z_far - z_near), 1.0f
+        ) * light_rotation;
+        cascade.far_distance = split_far;
+        cascade.depth_range = z_far - z_near;
+        cascade.texel_size = texel;
+        split_near = split_far;
+    }
+}
+
+/*
+    阴影缓存：墙面等静态投影物单独渲染到一张深度图中，只在光源转过一定角度或缓存过久时重新渲染。
+    每帧把它复制到阴影图后只绘制动态投影物。缓存期间阴影图使用缓存时的光源方向。
+*/
+const bool SHADOW_CACHE = true;
+/* 光源方向与缓存时的方向夹角超过该值(弧度)时重新渲染静态层 */
+const float SHADOW_CACHE_ANGLE_THRESHOLD = 0.02f;
+/* 静态层最多缓存的帧数，为 0 时只由光源旋转触发重新渲染 */
+const uint32_t SHADOW_CACHE_REFRESH_INTERVAL = 120;
+
+struct ShadowCache
+{
+    uint32_t texture, framebuffer;
+    Vec3f light_direction;
+    Matrix cascade_mats[MAX_SHADOW_CASCADES];
+    uint32_t age;
+    bool valid = false;
+
+    /* 判断本帧是否需要重新渲染静态层，需要时记录新的光源方向 */
+    bool Update(Vec3f direction)
+    {
+        bool refresh = !SHADOW_CACHE || !valid ||
+            dot(normalize(direction), normalize(light_direction)) < cos(SHADOW_CACHE_ANGLE_THRESHOLD) ||
+            (SHADOW_CACHE_REFRESH_INTERVAL && age + 1 >= SHADOW_CACHE_REFRESH_INTERVAL);
+        if (refresh)
+        {
+            light_direction = direction;
+            age = 0;
+            valid = true;
+        }
+        else age++;
+        return refresh;
+    }
+
+    /* 记录本帧各级联的矩阵，与缓存时不同(例如相机移动)时静态层需要重新渲染 */
+    bool CascadesChanged()
+    {
+        bool changed = false;
+        for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
+            if (memcmp(&cascade_mats[c], &shadow_cascades[c].mat, sizeof(Matrix)))
+            {
+                cascade_mats[c] = shadow_cascades[c].mat;
+                changed = true;
+            }
+        return changed;
+    }
+};
+
+ShadowCache shadow_cache;
+
+/*
+    用 GL_TIME_ELAPSED 查询测量 GPU 用时。结果在之后的帧中读取以免等待 GPU，
+    每次测量带有一个标签，各标签最近一次的结果保存在 elapsed_ms 中，total_ms 与 samples 用于求平均。
+*/
+const int GPU_TIMER_QUERIES = 4;
+
+struct GPUTimer
+{
+    uint32_t queries[GPU_TIMER_QUERIES];
+    int tags[GPU_TIMER_QUERIES];
+    bool pending[GPU_TIMER_QUERIES];
+    int next = 0;
+    bool active = false;
+    std::vector<double> elapsed_ms, total_ms;
+    std::vector<uint32_t> samples;
+
+    void Create(int tag_count)
+    {
+        glCreateQueries(GL_TIME_ELAPSED, GPU_TIMER_QUERIES, queries);
+        for (int i = 0; i < GPU_TIMER_QUERIES; i++) pending[i] = false;
+        elapsed_ms.assign(tag_count, 0.0);
+        total_ms.assign(tag_count, 0.0);
+        samples.assign(tag_count, 0);
+    }
+
+    /* 读取查询 i 的结果，结果还没有就绪时会等待 GPU */
+    void Collect(int i)
+    {
+        uint64_t elapsed_ns = 0;
+        glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &elapsed_ns);
+        elapsed_ms[tags[i]] = elapsed_ns * 1e-6;
+        total_ms[tags[i]] += elapsed_ns * 1e-6;
+        samples[tags[i]]++;
+        pending[i] = false;
+    }
+
+    void Poll()
+    {
+        for (int i = 0; i < GPU_TIMER_QUERIES; i++)
+        {
+            if (!pending[i]) continue;
+            int32_t available = 0;
+            glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) Collect(i);
+        }
+    }
+
+    /* 等待所有未完成的查询，在汇总平均值之前调用 */
+    void Drain()
+    {
+        for (int i = 0; i < GPU_TIMER_QUERIES; i++)
+            if (pending[i]) Collect(i);
+    }
+
+    /* 所有查询都在等待结果时跳过本次测量；wait 为 true 时等待最早的查询，每次都会测量 */
+    void Begin(int tag, bool wait = false)
+    {
+        Poll();
+        if (pending[next])
+        {
+            if (!wait) return;
+            Collect(next);
+        }
+        glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+        tags[next] = tag;
+        active = true;
+    }
+
+    void End()
+    {
+        if (!active) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        pending[next] = true;
+        next = (next + 1) % GPU_TIMER_QUERIES;
+        active = false;
+    }
+};
+
+/* 阴影渲染过程的计时标签：只绘制动态投影物的帧与重新渲染静态层的帧 */
+enum ShadowPassTag { SHADOW_PASS_CACHED, SHADOW_PASS_FULL };
+GPUTimer shadow_timer;
+
+/*
+    阴影过滤方式。GRID 为 (2*8+1)^2 的规则网格，POISSON 为按像素随机旋转的泊松圆盘，
+    PCSS 先在深度图中搜索遮挡物，再按估计的半影宽度缩放泊松圆盘。深度比较都由 sampler2DShadow 完成，
+    开启线性过滤后每次采样就是一次 2x2 的比较过滤。
+    VSM 与 EVSM 读取预先模糊过的矩纹理，只需一次带过滤的采样。
+*/
+enum ShadowFilterMode
+{
+    SHADOW_FILTER_GRID, SHADOW_FILTER_POISSON, SHADOW_FILTER_PCSS, SHADOW_FILTER_VSM, SHADOW_FILTER_EVSM,
+    SHADOW_FILTER_MODE_COUNT
+};
+const char* SHADOW_FILTER_MODE_NAMES[SHADOW_FILTER_MODE_COUNT] = { "grid", "poisson", "pcss", "vsm", "evsm" };
+
+bool ShadowFilterUsesMoments(int mode) { return mode == SHADOW_FILTER_VSM || mode == SHADOW_FILTER_EVSM; }
+/* 着色器中泊松圆盘的采样点数，也是运行时采样数的上限 */
+const int MAX_SHADOW_FILTER_TAPS = 32;
+/* 泊松圆盘的半径(级联像素数)，以及 PCSS 中光源的角直径(弧度) */
+const float SHADOW_FILTER_RADIUS = 3.0f;
+const float SHADOW_LIGHT_ANGLE = 0.02f;
+
+struct ShadowFilterSettings
+{
+    int mode;
+    int taps;
+    /* 规则网格的半径，网格为 (2 * grid_radius + 1)^2 */
+    int grid_radius;
+};
+
+ShadowFilterSettings shadow_filter = { SHADOW_FILTER_POISSON, 16, 8 };
+
+/* 每个片元读取阴影图的次数 */
+int ShadowFilterTaps(const ShadowFilterSettings& settings)
+{
+    if (settings.mode == SHADOW_FILTER_GRID) return (2 * settings.grid_radius + 1) * (2 * settings.grid_radius + 1);
+    if (ShadowFilterUsesMoments(settings.mode)) return 1;
+    return settings.taps;
+}
+
+/*
+    矩阴影图的参数。模糊半径以像素为单位；光渗透抑制把 Chebyshev 上界低于该值的部分视为完全遮挡，
+    可在运行时用 , 与 . 调整；最小方差避免平面上的自遮挡。EVSM 的正负指数分别为 40 与 5，需要 32 位浮点纹理。
+*/
+const int SHADOW_BLUR_RADIUS = 2;
+float shadow_bleed_reduction = 0.3f;
+const float SHADOW_MIN_VARIANCE = 0.00002f;
+const float EVSM_POSITIVE_EXPONENT = 40.0f;
+const float EVSM_NEGATIVE_EXPONENT = 5.0f;
+
+/* 同一张深度图集分别通过两个采样器对象读取：带比较的线性过滤用于阴影，不带比较的用于 PCSS 的遮挡物搜索 */
+uint32_t shadow_compare_sampler, shadow_depth_sampler;
+
+void CreateShadowSamplers()
+{
+    glCreateSamplers(1, &shadow_compare_sampler);
+    glSamplerParameteri(shadow_compare_sampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glSamplerParameteri(shadow_compare_sampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glSamplerParameteri(shadow_compare_sampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadow_compare_sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadow_compare_sampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glSamplerParameteri(shadow_compare_sampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindSampler(0, shadow_compare_sampler);
+
+    glCreateSamplers(1, &shadow_depth_sampler);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadow_depth_sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindSampler(1, shadow_depth_sampler);
+}
+
+/*
+    阴影过滤基准测试：相机、光源与小球固定不动，依次使用每种过滤设置渲染若干帧，
+    最后输出最终画面渲染过程的平均 GPU 用时，即不同过滤方式的片元着色器开销。
+*/
+const ShadowFilterSettings SHADOW_BENCHMARK_CONFIGS[] = {
+    { SHADOW_FILTER_GRID, 0, 8 },
+    { SHADOW_FILTER_POISSON, 8, 8 }, { SHADOW_FILTER_POISSON, 16, 8 }, { SHADOW_FILTER_POISSON, 32, 8 },
+    { SHADOW_FILTER_PCSS, 8, 8 }, { SHADOW_FILTER_PCSS, 16, 8 }, { SHADOW_FILTER_PCSS, 32, 8 },
+    { SHADOW_FILTER_VSM, 0, 8 }, { SHADOW_FILTER_EVSM, 0, 8 },
+};
+const int SHADOW_BENCHMARK_CONFIG_COUNT = sizeof(SHADOW_BENCHMARK_CONFIGS) / sizeof(SHADOW_BENCHMARK_CONFIGS[0]);
+const int SHADOW_BENCHMARK_FRAMES = 120;
+
+/* 最终画面渲染过程的计时，以及生成矩阴影图的计时 */
+GPUTimer main_pass_timer;
+GPUTimer moments_timer;
+
+struct ShadowFilterBenchmark
+{
+    bool running = false;
+    int config = 0;
+    int frame = 0;
+    ShadowFilterSettings saved;
+
+    void Start()
+    {
+        running = true;
+        config = frame = 0;
+        saved = shadow_filter;
+        for (int i = 0; i < SHADOW_BENCHMARK_CONFIG_COUNT; i++)
+        {
+            main_pass_timer.total_ms[i] = 0.0;
+            main_pass_timer.samples[i] = 0;
+        }
+        moments_timer.total_ms[0] = 0.0;
+        moments_timer.samples[0] = 0;
+        std::cout << "Shadow filter benchmark started" << std::endl;
+    }
+
+    /* 设置本帧使用的过滤方式，全部设置测量完成后输出结果并恢复原来的设置 */
+    void Update()
+    {
+        if (!running) return;
+        if (frame == SHADOW_BENCHMARK_FRAMES)
+        {
+            frame = 0;
+            if (++config == SHADOW_BENCHMARK_CONFIG_COUNT)
+            {
+                running = false;
+                shadow_filter = saved;
+                Report();
+                return;
+            }
+        }
+        shadow_filter = SHADOW_BENCHMARK_CONFIGS[config];
+        frame++;
+    }
+
+    void Report()
+    {
+        main_pass_timer.Drain();
+        moments_timer.Drain();
+        std::cout << "Shadow filter benchmark (main pass GPU time):" << std::endl;
+        for (int i = 0; i < SHADOW_BENCHMARK_CONFIG_COUNT; i++)
+        {
+            const ShadowFilterSettings& settings = SHADOW_BENCHMARK_CONFIGS[i];
+            uint32_t samples = main_pass_timer.samples[i];
+            std::cout << "    " << SHADOW_FILTER_MODE_NAMES[settings.mode] << " " << ShadowFilterTaps(settings) << " taps"
+                << ": " << (samples ? main_pass_timer.total_ms[i] / samples : 0.0) << "ms over " << samples << " frames";
+            if (ShadowFilterUsesMoments(settings.mode) && moments_timer.samples[0])
+                std::cout << " (+" << moments_timer.total_ms[0] / moments_timer.samples[0] << "ms moments per update)";
+            std::cout << std::endl;
+        }
+    }
+};
+
+ShadowFilterBenchmark shadow_benchmark;
+
+/* 基准测试时以设置编号作为计时标签，平时使用最后一个标签 */
+int MainPassTimerTag()
+{
+    return shadow_benchmark.running ? shadow_benchmark.config : SHADOW_BENCHMARK_CONFIG_COUNT;
+}
+
+uint32_t tex_shader_program_object;
+
+bool ReadFileContents(const char* file_path, std::string& text)
+{
+    FILE* file = nullptr;
+#ifdef _WIN32
+    fopen_s(&file, file_path, "rb");
+#else
+    file = fopen(file_path, "rb");
+#endif
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    int64_t length = ftell(file);
+    text.assign(length, '\0');
+    fseek(file, 0, SEEK_SET);
+    fread(&text[0], 1, length, file);
+    fclose(file);
+    return true;
+}
+
+/*
+    着色器预处理：把 #include "文件名" 所在的行替换为该文件的内容，每个文件只展开一次。
+    GLSL 本身不支持 #include，展开后的源码作为一个字符串提交给驱动。
+*/
+bool ExpandShaderIncludes(const char* file_path, std::set<std::string>& included, std::string& source)
+{
+    std::string text;
+    if (!ReadFileContents(file_path, text))
+    {
+        std::cout << "Cannot open shader file " << file_path << std::endl;
+        return false;
+    }
+    included.insert(file_path);
+    size_t begin = 0;
+    while (begin < text.size())
+    {
+        size_t end = text.find('\n', begin);
+        end = (end == std::string::npos) ? text.size() : end + 1;
+        size_t first = text.find_first_not_of(" \t", begin);
+        if (first < end && text.compare(first, 8, "#include") == 0)
+        {
+            size_t open = text.find('"', first), close = text.find('"', open + 1);
+            if (open >= end || close >= end)
+            {
+                std::cout << file_path << ": malformed #include" << std::endl;
+                return false;
+            }
+            std::string name = text.substr(open + 1, close - open - 1);
+            if (!included.count(name) && !ExpandShaderIncludes(name.c_str(), included, source)) return false;
+            if (!source.empty() && source.back() != '\n') source += '\n';
+        }
+        else
+            source.append(text, begin, end - begin);
+        begin = end;
+    }
+    return true;
+}
+
+/* 展开 #include，并把 defines (若干行 #define) 插入到 #version 行之后 */
+bool PreprocessShaderFile(const char* shader_file_path, const std::string& defines, std::string& source)
+{
+    std::set<std::string> included;
+    source.clear();
+    if (!ExpandShaderIncludes(shader_file_path, included, source)) return false;
+    size_t version = source.find("#version");
+    size_t insert_at = (version == std::string::npos) ? 0 : source.find('\n', version);
+    insert_at = (insert_at == std::string::npos) ? source.size() : insert_at + 1;
+    source.insert(insert_at, defines);
+    return true;
+}
+
+/* 提交编译，不查询结果 */
+uint32_t SubmitShaderCompile(const std::string& source, uint32_t shader_type)
+{
+    uint32_t shader_object = glCreateShader(shader_type);
+    const char* source_code = source.c_str();
+    glShaderSource(shader_object, 1, &source_code, nullptr);
+    glCompileShader(shader_object);
+    return shader_object;
+}
+
+/* 查询编译结果，失败时输出错误信息，shader_file_path 只用于输出 */
+bool ShaderCompiled(uint32_t shader_object, const char* shader_file_path)
+{
+    int32_t compilation_success;
+    glGetShaderiv(shader_object, GL_COMPILE_STATUS, &compilation_success);
+    if (!compilation_success)
+    {
+        int32_t log_length;
+        glGetShaderiv(shader_object, GL_INFO_LOG_LENGTH, &log_length);
+        char* error_info = new char[log_length + 1];
+        glGetShaderInfoLog(shader_object, log_length + 1, &log_length, error_info);
+        std::cout << shader_file_path << ":\n" << error_info << std::endl;
+        delete[] error_info;
+        return false;
+    }
+    return true;
+}
+
+uint32_t CompileGLSLShaderSource(const char* shader_file_path, const std::string& source, uint32_t shader_type)
+{
+    uint32_t shader_object = SubmitShaderCompile(source, shader_type);
+    if (!ShaderCompiled(shader_object, shader_file_path))
+    {
+        glDeleteShader(shader_object);
+        return 0;
+    }
+    return shader_object;
+}
+
+/* 查询链接结果，失败时输出错误信息并删除程序 */
+bool ProgramLinked(uint32_t program_object)
+{
+    int32_t link_success;
+    glGetProgramiv(program_object, GL_LINK_STATUS, &link_success);
+    if (!link_success)
+    {
+        int32_t log_length;
+        glGetProgramiv(program_object, GL_INFO_LOG_LENGTH, &log_length);
+        char * error_info = new char [log_length + 1];
+        glGetProgramInfoLog(program_object, log_length + 1, &log_length, error_info);
+        std::cout << error_info << std::endl;
+        glDeleteProgram(program_object);
+        delete[] error_info;
+        return false;
+    }
+    return true;
+}
+
+/* retrievable 为 true 时链接之后可以用 glGetProgramBinary 取出程序的二进制 */
+uint32_t LinkProgram(uint32_t vs_object, uint32_t fs_object, bool retrievable = false)
+{
+    uint32_t program_object = glCreateProgram();
+    glAttachShader(program_object, vs_object);
+    glAttachShader(program_object, fs_object);
+    if (retrievable) glProgramParameteri(program_object, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program_object);
+    return ProgramLinked(program_object) ? program_object : 0;
+}
+
+/*
+    程序二进制缓存：链接成功的程序用 glGetProgramBinary 取出，保存在 PROGRAM_CACHE_DIRECTORY 中，
+    下次启动时用 glProgramBinary 直接载入，跳过编译与链接。
+    键为预处理后的全部源码与 GL_RENDERER、GL_VERSION 的 64 位 FNV-1a 散列，驱动或源码改变后自然失效；
+    驱动拒绝载入(链接状态为失败)时退回到编译，并覆盖缓存文件。
+*/
+const bool PROGRAM_BINARY_CACHE = true;
+const char* PROGRAM_CACHE_DIRECTORY = "shader_cache";
+const uint32_t PROGRAM_CACHE_MAGIC = 0x4E494250;    /* "PBIN" */
+
+/* 缓存文件头，之后是 length 字节的程序二进制 */
+struct ProgramCacheHeader
+{
+    uint32_t magic;
+    uint32_t binary_format;
+    uint64_t key;
+    uint32_t length;
+    /* 生成该二进制时编译与链接的用时，用于估计命中时节省的时间 */
+    float compile_ms;
+};
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+struct ProgramBinaryCache
+{
+    bool enabled = false;
+    uint64_t driver_hash;
+    uint32_t hits = 0, misses = 0, rejected = 0;
+    double saved_ms = 0.0;
+
+    void Init()
+    {
+        int32_t formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        enabled = PROGRAM_BINARY_CACHE && formats > 0;
+        if (!enabled) return;
+        const char* renderer = (const char*)glGetString(GL_RENDERER);
+        const char* version = (const char*)glGetString(GL_VERSION);
+        driver_hash = HashBytes(renderer, strlen(renderer));
+        driver_hash = HashBytes(version, strlen(version), driver_hash);
+#ifdef _WIN32
+        _mkdir(PROGRAM_CACHE_DIRECTORY);
+#else
+        mkdir(PROGRAM_CACHE_DIRECTORY, 0755);
+#endif
+    }
+
+    std::string FilePath(uint64_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+        return PROGRAM_CACHE_DIRECTORY + std::string(name);
+    }
+
+    /* 缓存中有可用的二进制时返回载入后的程序，否则返回 0 */
+    uint32_t Load(uint64_t key)
+    {
+        std::string text;
+        if (!ReadFileContents(FilePath(key).c_str(), text) || text.size() < sizeof(ProgramCacheHeader)) return 0;
+        ProgramCacheHeader header;
+        memcpy(&header, text.data(), sizeof(header));
+        if (header.magic != PROGRAM_CACHE_MAGIC || header.key != key || text.size() != sizeof(header) + header.length) return 0;
+
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        uint32_t program = glCreateProgram();
+        glProgramBinary(program, header.binary_format, text.data() + sizeof(header), header.length);
+        int32_t link_success;
+        glGetProgramiv(program, GL_LINK_STATUS, &link_success);
+        if (!link_success)
+        {
+            glDeleteProgram(program);
+            rejected++;
+            return 0;
+        }
+        hits++;
+        saved_ms += header.compile_ms - std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        return program;
+    }
+
+    void Store(uint64_t key, uint32_t program, double compile_ms)
+    {
+        int32_t length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+        std::vector<uint8_t> data(sizeof(ProgramCacheHeader) + length);
+        ProgramCacheHeader header;
+        header.magic = PROGRAM_CACHE_MAGIC;
+        header.key = key;
+        header.compile_ms = (float)compile_ms;
+        glGetProgramBinary(program, length, &length, &header.binary_format, data.data() + sizeof(header));
+        header.length = length;
+        memcpy(data.data(), &header, sizeof(header));
+
+        FILE* file = nullptr;
+#ifdef _WIN32
+        fopen_s(&file, FilePath(key).c_str(), "wb");
+#else
+        file = fopen(FilePath(key).c_str(), "wb");
+#endif
+        if (!file) return;
+        fwrite(data.data(), 1, sizeof(header) + length, file);
+        fclose(file);
+    }
+
+    void Report()
+    {
+        if (!enabled)
+        {
+            std::cout << "Program binary cache: disabled" << std::endl;
+            return;
+        }
+        uint32_t total = hits + misses;
+        std::cout << "Program binary cache: " << hits << "/" << total << " hits ("
+            << (total ? 100.0 * hits / total : 0.0) << "%), " << rejected << " rejected, saved " << saved_ms << "ms" << std::endl;
+    }
+};
+
+ProgramBinaryCache program_cache;
+
+uint64_t ProgramCacheKey(const std::string& vs_source, const std::string& fs_source)
+{
+    uint64_t key = HashBytes(vs_source.data(), vs_source.size(), program_cache.driver_hash);
+    key = HashBytes("\0", 1, key);
+    return HashBytes(fs_source.data(), fs_source.size(), key);
+}
+
+/* 由顶点与片段着色器文件创建程序，fs_defines 注入片段着色器，经过程序二进制缓存 */
+uint32_t LoadProgram(const char* vs_path, const char* fs_path, const std::string& fs_defines = std::string())
+{
+    std::string vs_source, fs_source;
+    if (!PreprocessShaderFile(vs_path, std::string(), vs_source) || !PreprocessShaderFile(fs_path, fs_defines, fs_source)) return 0;
+    uint64_t key = 0;
+    if (program_cache.enabled)
+    {
+        key = ProgramCacheKey(vs_source, fs_source);
+        uint32_t program = program_cache.Load(key);
+        if (program) return program;
+        program_cache.misses++;
+    }
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    uint32_t vertex_shader_object = CompileGLSLShaderSource(vs_path, vs_source, GL_VERTEX_SHADER);
+    uint32_t fragment_shader_object = CompileGLSLShaderSource(fs_path, fs_source, GL_FRAGMENT_SHADER);
+    uint32_t program = (vertex_shader_object && fragment_shader_object) ?
+        LinkProgram(vertex_shader_object, fragment_shader_object, program_cache.enabled) : 0;
+    glDeleteShader(vertex_shader_object);
+    glDeleteShader(fragment_shader_object);
+    if (program && program_cache.enabled)
+        program_cache.Store(key, program, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+    return program;
+}
+
+/*
+    异步创建程序：工作线程读取并预处理着色器文件，主线程提交编译与链接。
+    驱动支持 GL_KHR_parallel_shader_compile 时编译与链接在驱动的线程中进行，主线程每帧用
+    GL_COMPLETION_STATUS_KHR 查询是否完成，不会阻塞；不支持时在源码就绪的那一帧同步编译。
+    ASYNC_SHADER_COMPILATION 为 false 时在请求处等待程序可用，用于比较首帧时间。
+*/
+const bool ASYNC_SHADER_COMPILATION = true;
+
+/* GL 4.6 核心模式的加载器中没有扩展，常量与函数需要自己定义 */
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+bool parallel_shader_compile = false;
+
+void InitParallelShaderCompile()
+{
+    int32_t count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (int32_t i = 0; i < count; i++)
+    {
+        const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (!strcmp(name, "GL_KHR_parallel_shader_compile") || !strcmp(name, "GL_ARB_parallel_shader_compile"))
+            parallel_shader_compile = true;
+    }
+    if (!parallel_shader_compile) return;
+    PFNGLMAXSHADERCOMPILERTHREADSKHRPROC max_threads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+    if (!max_threads) max_threads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsARB");
+    /* 0xFFFFFFFF 表示由驱动决定线程数 */
+    if (max_threads) max_threads(0xFFFFFFFF);
+}
+
+/* 不支持并行编译时，查询结果本身就会等待编译完成 */
+bool ShaderCompletionStatus(uint32_t shader_object)
+{
+    if (!parallel_shader_compile) return true;
+    int32_t done;
+    glGetShaderiv(shader_object, GL_COMPLETION_STATUS_KHR, &done);
+    return done != 0;
+}
+
+bool ProgramCompletionStatus(uint32_t program_object)
+{
+    if (!parallel_shader_compile) return true;
+    int32_t done;
+    glGetProgramiv(program_object, GL_COMPLETION_STATUS_KHR, &done);
+    return done != 0;
+}
+
+struct AsyncProgram
+{
+    enum State { LOADING, COMPILING, LINKING, READY, FAILED };
+
+    std::string vs_path, fs_path, fs_defines;
+    /* 由工作线程写入，source_ready 置位之后主线程才能读取 */
+    std::string vs_source, fs_source;
+    bool source_ok = false;
+    std::atomic<bool> source_ready;
+
+    State state = LOADING;
+    uint64_t key = 0;
+    uint32_t vertex_shader_object = 0, fragment_shader_object = 0, program = 0;
+    std::chrono::steady_clock::time_point begin, compile_begin;
+    /* 从请求到可用的用时 */
+    double ready_ms = 0.0;
+
+    AsyncProgram(const char* _vs_path, const char* _fs_path, const std::string& _fs_defines)
+        : vs_path(_vs_path), fs_path(_fs_path), fs_defines(_fs_defines), source_ready(false)
+    {
+        begin = std::chrono::steady_clock::now();
+    }
+
+    bool Finished() const { return state == READY || state == FAILED; }
+
+    void Finish(State result)
+    {
+        state = result;
+        ready_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    /* 在不等待驱动的前提下尽量向前推进 */
+    void Advance()
+    {
+        if (state == LOADING)
+        {
+            if (!source_ready.load(std::memory_order_acquire)) return;
+            if (!source_ok) return Finish(FAILED);
+            if (program_cache.enabled)
+            {
+                key = ProgramCacheKey(vs_source, fs_source);
+                program = program_cache.Load(key);
+                if (program) return Finish(READY);
+                program_cache.misses++;
+            }
+            compile_begin = std::chrono::steady_clock::now();
+            vertex_shader_object = SubmitShaderCompile(vs_source, GL_VERTEX_SHADER);
+            fragment_shader_object = SubmitShaderCompile(fs_source, GL_FRAGMENT_SHADER);
+            state = COMPILING;
+        }
+        if (state == COMPILING)
+        {
+            if (!ShaderCompletionStatus(vertex_shader_object) || !ShaderCompletionStatus(fragment_shader_object)) return;
+            bool compiled = ShaderCompiled(vertex_shader_object, vs_path.c_str());
+            compiled = ShaderCompiled(fragment_shader_object, fs_path.c_str()) && compiled;
+            if (!compiled)
+            {
+                glDeleteShader(vertex_shader_object);
+                glDeleteShader(fragment_shader_object);
+                return Finish(FAILED);
+            }
+            program = glCreateProgram();
+            glAttachShader(program, vertex_shader_object);
+            glAttachShader(program, fragment_shader_object);
+            if (program_cache.enabled) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            glLinkProgram(program);
+            state = LINKING;
+        }
+        if (state == LINKING)
+        {
+            if (!ProgramCompletionStatus(program)) return;
+            glDeleteShader(vertex_shader_object);
+            glDeleteShader(fragment_shader_object);
+            if (!ProgramLinked(program))
+            {
+                program = 0;
+                return Finish(FAILED);
+            }
+            if (program_cache.enabled)
+                program_cache.Store(key, program, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - compile_begin).count());
+            Finish(READY);
+        }
+    }
+
+    void Wait()
+    {
+        while (!Finished())
+        {
+            Advance();
+            if (!Finished()) std::this_thread::yield();
+        }
+    }
+};
+
+/* 读取并预处理着色器文件的工作线程 */
+struct ShaderSourceLoader
+{
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<AsyncProgram*> queue;
+    bool quit = false;
+
+    ~ShaderSourceLoader() { Stop(); }
+
+    /* 结束工作线程，之后提交的请求在调用线程中直接读取 */
+    void Stop()
+    {
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    void Start()
+    {
+        worker = std::thread([this]() { WorkerLoop(); });
+    }
+
+    static void Load(AsyncProgram* request)
+    {
+        request->source_ok =
+            PreprocessShaderFile(request->vs_path.c_str(), std::string(), request->vs_source) &&
+            PreprocessShaderFile(request->fs_path.c_str(), request->fs_defines, request->fs_source);
+        request->source_ready.store(true, std::memory_order_release);
+    }
+
+    void Submit(AsyncProgram* request)
+    {
+        if (!worker.joinable())
+        {
+            Load(request);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(request);
+        }
+        cv.notify_one();
+    }
+
+    void WorkerLoop()
+    {
+        for (;;)
+        {
+            AsyncProgram* request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return quit || !queue.empty(); });
+                if (quit) return;
+                request = queue.front();
+                queue.erase(queue.begin());
+            }
+            Load(request);
+        }
+    }
+};
+
+ShaderSourceLoader shader_loader;
+
+void InitStaticGeometry();
+
+/* 创建深度图集大小的深度纹理及只有深度附件的帧缓冲 */
+void CreateShadowMapTarget(uint32_t& texture, uint32_t& framebuffer)
+{
+    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, shadow_atlas_width, shadow_atlas_height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glCreateFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/*
+    矩阴影图：先把深度图集转换为矩并做水平方向的高斯模糊，再做竖直方向的模糊，最后生成 mipmap。
+    两个方向的模糊都限制在各自的级联内。纹理在第一次使用 VSM 或 EVSM 时才创建。
+*/
+struct ShadowMoments
+{
+    /*
+        textures[0] 为最终的矩纹理(带 mipmap)，textures[1] 为水平模糊的中间结果。
+        framebuffers[2] 用于生成 mipmap，每一级重新设置附件。
+    */
+    uint32_t textures[2], framebuffers[3];
+    /* mipmap 的级别数，最粗的一级中每个级联只剩一个像素，再往下各级联就会混在一起 */
+    uint32_t level_count;
+    int32_t pass_location, mode_location, radius_location, exponents_location, cascade_rect_location, cascade_count_location, source_rect_location;
+    uint32_t program = 0;
+    bool created = false;
+
+    void Create()
+    {
+        if (!program) CreateProgram();
+        uint32_t min_size = shadow_cascades[0].size;
+        for (int c = 1; c < SHADOW_CASCADE_COUNT; c++) min_size = std::min(min_size, shadow_cascades[c].size);
+        level_count = 1;
+        while ((min_size >> level_count) > 0) level_count++;
+        glCreateTextures(GL_TEXTURE_2D, 2, textures);
+        glTextureStorage2D(textures[0], level_count, GL_RGBA32F, shadow_atlas_width, shadow_atlas_height);
+        glTextureStorage2D(textures[1], 1, GL_RGBA32F, shadow_atlas_width, shadow_atlas_height);
+        glTextureParameteri(textures[0], GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTextureParameteri(textures[0], GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTextureParameteri(textures[1], GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTextureParameteri(textures[1], GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        for (int i = 0; i < 2; i++)
+        {
+            glTextureParameteri(textures[i], GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTextureParameteri(textures[i], GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glCreateFramebuffers(1, &framebuffers[i]);
+            glNamedFramebufferTexture(framebuffers[i], GL_COLOR_ATTACHMENT0, textures[i], 0);
+        }
+        glCreateFramebuffers(1, &framebuffers[2]);
+        created = true;
+        std::cout << "Shadow moments: " << shadow_atlas_width * shadow_atlas_height * 16 * 2 / 1048576.0 << "MB" << std::endl;
+    }
+
+    /* 阴影图集大小改变时释放纹理，下次使用时按新的大小重新创建 */
+    void Destroy()
+    {
+        if (!created) return;
+        glDeleteFramebuffers(3, framebuffers);
+        glDeleteTextures(2, textures);
+        created = false;
+    }
+
+    void CreateProgram()
+    {
+        program = LoadProgram("moments_vertex_shader.glsl", "moments_fragment_shader.glsl");
+        pass_location = glGetUniformLocation(program, "blur_pass");
+        mode_location = glGetUniformLocation(program, "moments_mode");
+        radius_location = glGetUniformLocation(program, "blur_radius");
+        exponents_location = glGetUniformLocation(program, "evsm_exponents");
+        cascade_rect_location = glGetUniformLocation(program, "cascade_rect");
+        cascade_count_location = glGetUniformLocation(program, "cascade_count");
+        source_rect_location = glGetUniformLocation(program, "source_rect");
+    }
+
+    /* 由当前的深度图集生成模糊后的矩纹理，每次阴影图更新后调用 */
+    void Generate(int mode, const float cascade_rect[][4])
+    {
+        if (!created) Create();
+        moments_timer.Begin(0, shadow_benchmark.running);
+        glProgramUniform1i(program, mode_location, mode == SHADOW_FILTER_EVSM ? 1 : 0);
+        glProgramUniform1i(program, radius_location, SHADOW_BLUR_RADIUS);
+        glProgramUniform2f(program, exponents_location, EVSM_POSITIVE_EXPONENT, EVSM_NEGATIVE_EXPONENT);
+        glProgramUniform4fv(program, cascade_rect_location, SHADOW_CASCADE_COUNT, (const float*)cascade_rect);
+        glProgramUniform1i(program, cascade_count_location, SHADOW_CASCADE_COUNT);
+
+        gl_state.UseProgram(program);
+        gl_state.BindVertexArray(vertex_array_cache.Get(VERTEX_LAYOUT_POSITION));
+        gl_state.BindTextureUnit(1, depth_map_object);
+        gl_state.BindTextureUnit(3, textures[1]);
+        glViewport(0, 0, shadow_atlas_width, shadow_atlas_height);
+        for (int pass = 0; pass < 2; pass++)
+        {
+            gl_state.BindFramebuffer(framebuffers[1 - pass]);
+            glProgramUniform1i(program, pass_location, pass);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+        }
+
+        /*
+            不使用 glGenerateTextureMipmap：它对整个图集滤波，粗糙的级别会混入相邻级联。
+            这里逐级、逐个级联地生成，每个级联只读取上一级中自己的区域。
+            生成第 level 级时把纹理的可访问级别限制为 level - 1，避免读写同一级。
+        */
+        gl_state.BindFramebuffer(framebuffers[2]);
+        gl_state.BindTextureUnit(3, textures[0]);
+        glProgramUniform1i(program, pass_location, 2);
+        for (uint32_t level = 1; level < level_count; level++)
+        {
+            glTextureParameteri(textures[0], GL_TEXTURE_BASE_LEVEL, level - 1);
+            glTextureParameteri(textures[0], GL_TEXTURE_MAX_LEVEL, level - 1);
+            glNamedFramebufferTexture(framebuffers[2], GL_COLOR_ATTACHMENT0, textures[0], level);
+            for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
+            {
+                const ShadowCascade& cascade = shadow_cascades[c];
+                int32_t source_size = std::max(1u, cascade.size >> (level - 1)), size = std::max(1u, cascade.size >> level);
+                glProgramUniform4i(program, source_rect_location, cascade.offset_x >> (level - 1), 0, source_size, source_size);
+                glViewport(cascade.offset_x >> level, 0, size, size);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+            }
+        }
+        glTextureParameteri(textures[0], GL_TEXTURE_BASE_LEVEL, 0);
+        glTextureParameteri(textures[0], GL_TEXTURE_MAX_LEVEL, level_count - 1);
+        moments_timer.End();
+    }
+};
+
+ShadowMoments shadow_moments;
+
+/* 按新的分辨率重新创建阴影图集及其缓存、矩纹理，静态层在下一帧重新渲染 */
+void ResizeShadowAtlas(uint32_t resolution_shift)
+{
+    if (resolution_shift == shadow_resolution_shift) return;
+    glDeleteFramebuffers(1, &depth_map_framebuffer_object);
+    glDeleteTextures(1, &depth_map_object);
+    if (SHADOW_CACHE)
+    {
+        glDeleteFramebuffers(1, &shadow_cache.framebuffer);
+        glDeleteTextures(1, &shadow_cache.texture);
+    }
+    shadow_moments.Destroy();
+
+    shadow_resolution_shift = resolution_shift;
+    InitShadowAtlasLayout();
+    CreateShadowMapTarget(depth_map_object, depth_map_framebuffer_object);
+    if (SHADOW_CACHE) CreateShadowMapTarget(shadow_cache.texture, shadow_cache.framebuffer);
+    shadow_cache.valid = false;
+    /* 新对象可能复用已删除对象的名字，状态缓存中的记录不再可信 */
+    gl_state.Invalidate();
+}
+
+/*
+    阴影质量调节器：每帧取 CPU 与 GPU 用时中较大者的滑动平均，在几个质量等级之间切换。
+    平均用时超出预算持续一段时间后降低一级，低于预算的一定比例更长时间后再升高一级，
+    两个阈值之间留有余量，避免在相邻等级之间来回切换。等级 0 为默认设置。
+*/
+struct ShadowQualityTier
+{
+    uint32_t resolution_shift;
+    int taps;
+    int grid_radius;
+};
+
+const ShadowQualityTier SHADOW_QUALITY_TIERS[] = {
+    { 0, 16, 8 }, { 0, 8, 6 }, { 1, 8, 4 }, { 1, 4, 3 }, { 2, 4, 2 },
+};
+const int SHADOW_QUALITY_TIER_COUNT = sizeof(SHADOW_QUALITY_TIERS) / sizeof(SHADOW_QUALITY_TIERS[0]);
+const bool SHADOW_GOVERNOR = true;
+const double FRAME_TIME_BUDGET_MS = 16.0;
+const double GOVERNOR_UPGRADE_RATIO = 0.6;
+const int GOVERNOR_DOWNGRADE_FRAMES = 30;
+const int GOVERNOR_UPGRADE_FRAMES = 180;
+/* 切换等级后等待的帧数，让平均值反映新设置的用时 */
+const int GOVERNOR_SETTLE_FRAMES = 30;
+
+struct ShadowGovernor
+{
+    int tier = 0;
+    double average_ms = 0.0;
+    int over_frames = 0, under_frames = 0, settle_frames = 0;
+
+    /* 记录一帧的用时，等级改变时返回 true */
+    bool Update(double frame_ms)
+    {
+        average_ms = average_ms * 0.9 + frame_ms * 0.1;
+        if (settle_frames > 0)
+        {
+            settle_frames--;
+            return false;
+        }
+        over_frames = (average_ms > FRAME_TIME_BUDGET_MS) ? over_frames + 1 : 0;
+        under_frames = (average_ms < FRAME_TIME_BUDGET_MS * GOVERNOR_UPGRADE_RATIO) ? under_frames + 1 : 0;
+        int new_tier = tier;
+        if (over_frames >= GOVERNOR_DOWNGRADE_FRAMES && tier + 1 < SHADOW_QUALITY_TIER_COUNT) new_tier = tier + 1;
+        if (under_frames >= GOVERNOR_UPGRADE_FRAMES && tier > 0) new_tier = tier - 1;
+        if (new_tier == tier) return false;
+        tier = new_tier;
+        over_frames = under_frames = 0;
+        settle_frames = GOVERNOR_SETTLE_FRAMES;
+        return true;
+    }
+
+    void Apply()
+    {
+        const ShadowQualityTier& settings = SHADOW_QUALITY_TIERS[tier];
+        ResizeShadowAtlas(settings.resolution_shift);
+        shadow_filter.taps = settings.taps;
+        shadow_filter.grid_radius = settings.grid_radius;
+        std::cout << "Shadow quality tier " << tier << ": " << shadow_cascades[0].size << " cascade resolution, "
+            << settings.taps << " taps, " << (2 * settings.grid_radius + 1) << "x" << (2 * settings.grid_radius + 1)
+            << " grid (average frame cost " << average_ms << "ms)" << std::endl;
+    }
+};
+
+ShadowGovernor shadow_governor;
+
+/*
+    分簇前向光照：把视锥体在屏幕上划分为 CLUSTER_X * CLUSTER_Y 个块，在深度方向按对数划分为 CLUSTER_Z 层，
+    CPU 每帧求出与每个簇相交的点光源，写入光源索引列表，片段着色器只遍历所在簇的列表。
+    点光源的衰减为 1 / (Kq * d^2 + Kp * d + Kc)，亮度降到 LIGHT_CUTOFF 的距离作为其作用范围，
+    着色器在作用范围内乘以一个平滑的窗口函数，使亮度在边界处降到 0，簇的边界不会产生接缝。
+*/
+const float Kq = 1.0, Kp = 0.0, Kc = 1.0;
+const float LIGHT_CUTOFF = 0.05;
+/* 点光源颜色的系数，上传前乘入颜色 */
+const float POINT_LIGHT_INTENSITY = 0.9;
+const int CLUSTER_X = 16, CLUSTER_Y = 16, CLUSTER_Z = 24;
+const int CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+/* 与主相机投影矩阵的近、远平面一致 */
+const float CLUSTER_NEAR = 1.0, CLUSTER_FAR = 100.0;
+
+/* 布局与着色器中的 PointLight (std430) 一致，位置在观察空间中 */
+struct PointLight
+{
+    Vec3f position;
+    float range;
+    Vec3f color;
+    float padding;
+};
+
+/* 簇的光源列表在索引数组中的区间 */
+struct LightCluster
+{
+    uint32_t offset;
+    uint32_t count;
+};
+
+float LightRange(Vec3f color)
+{
+    float intensity = fmaxf(fmaxf(color.x, color.y), color.z);
+    float c = Kc - intensity / LIGHT_CUTOFF;
+    if (c >= 0.0f) return 0.0f;
+    if (Kq == 0.0f) return (Kp > 0.0f) ? -c / Kp : CLUSTER_FAR;
+    return (-Kp + sqrtf(Kp * Kp - 4.0f * Kq * c)) / (2.0f * Kq);
+}
+
+/* 第 slice 层的起始深度 */
+float ClusterSliceDepth(int slice)
+{
+    return CLUSTER_NEAR * powf(CLUSTER_FAR / CLUSTER_NEAR, (float)slice / CLUSTER_Z);
+}
+
+int ClusterSlice(float depth)
+{
+    int slice = (int)floorf(logf(depth / CLUSTER_NEAR) / logf(CLUSTER_FAR / CLUSTER_NEAR) * CLUSTER_Z);
+    return std::min(std::max(slice, 0), CLUSTER_Z - 1);
+}
+
+/* 屏幕坐标 ndc (-1 到 1) 所在的块，count 为该方向上的块数 */
+int ClusterTile(float ndc, int count)
+{
+    int tile = (int)floorf((ndc * 0.5f + 0.5f) * count);
+    return std::min(std::max(tile, 0), count - 1);
+}
+
+StreamBuffer light_stream;
+
+struct LightClusterGrid
+{
+    std::vector<PointLight> lights;
+    std::vector<LightCluster> clusters;
+    std::vector<uint32_t> indices;
+    /* 投影矩阵中 x、y 方向的缩放 */
+    float scale_x, scale_y;
+    uint64_t light_offset, cluster_offset, index_offset;
+    double build_ms;
+
+    /*
+        对光源覆盖的每一层，取球与该层相交部分的包围盒投影到屏幕上的范围，
+        对范围内的每个簇调用 visit(cluster)。结果是保守的，不会漏掉与光源相交的簇。
+    */
+    template<typename Visit>
+    void ForEachCluster(const PointLight& light, Visit visit) const
+    {
+        float z_min = light.position.z - light.range, z_max = light.position.z + light.range;
+        if (z_max < CLUSTER_NEAR || z_min > CLUSTER_FAR) return;
+        int slice_begin = ClusterSlice(std::max(z_min, CLUSTER_NEAR));
+        int slice_end = ClusterSlice(std::min(z_max, CLUSTER_FAR));
+        for (int slice = slice_begin; slice <= slice_end; slice++)
+        {
+            float near = std::max(ClusterSliceDepth(slice), std::max(z_min, CLUSTER_NEAR));
+            float far = std::min(ClusterSliceDepth(slice + 1), z_max);
+            /* 球与该层相交部分在 x、y 方向上的半径 */
+            float dz = (light.position.z < near) ? near - light.position.z : (light.position.z > far ? light.position.z - far : 0.0f);
+            float radius = sqrtf(std::max(light.range * light.range - dz * dz, 0.0f));
+            /* x / z 在 z 的区间内是单调的，最值在区间端点处取得 */
+            float x0 = light.position.x - radius, x1 = light.position.x + radius;
+            float y0 = light.position.y - radius, y1 = light.position.y + radius;
+            int tile_x0 = ClusterTile(scale_x * std::min(x0 / near, x0 / far), CLUSTER_X);
+            int tile_x1 = ClusterTile(scale_x * std::max(x1 / near, x1 / far), CLUSTER_X);
+            int tile_y0 = ClusterTile(scale_y * std::min(y0 / near, y0 / far), CLUSTER_Y);
+            int tile_y1 = ClusterTile(scale_y * std::max(y1 / near, y1 / far), CLUSTER_Y);
+            for (int y = tile_y0; y <= tile_y1; y++)
+                for (int x = tile_x0; x <= tile_x1; x++)
+                    visit((slice * CLUSTER_Y + y) * CLUSTER_X + x);
+        }
+    }
+
+    /* lights 中的光源已经变换到观察空间，先统计每个簇的光源数，前缀和之后再填写索引 */
+    void Build(const Matrix& mat_proj)
+    {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        scale_x = mat_proj.m[0][0];
+        scale_y = mat_proj.m[1][1];
+        clusters.assign(CLUSTER_COUNT, LightCluster{ 0, 0 });
+        for (size_t i = 0; i < lights.size(); i++)
+            ForEachCluster(lights[i], [&](int cluster) { clusters[cluster].count++; });
+        uint32_t total = 0;
+        for (int i = 0; i < CLUSTER_COUNT; i++)
+        {
+            clusters[i].offset = total;
+            total += clusters[i].count;
+            clusters[i].count = 0;
+        }
+        indices.resize(total);
+        for (size_t i = 0; i < lights.size(); i++)
+            ForEachCluster(lights[i], [&](int cluster) { indices[clusters[cluster].offset + clusters[cluster].count++] = (uint32_t)i; });
+        build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    /* 三个数组写入流式缓冲区的当前区域，各自的起始偏移满足 SSBO 的对齐要求 */
+    void Upload()
+    {
+        uint64_t light_bytes = sizeof(PointLight) * std::max<size_t>(lights.size(), 1);
+        uint64_t cluster_bytes = sizeof(LightCluster) * clusters.size();
+        uint64_t index_bytes = sizeof(uint32_t) * std::max<size_t>(indices.size(), 1);
+        light_offset = 0;
+        cluster_offset = AlignUp(light_bytes, draw_data_alignment);
+        index_offset = cluster_offset + AlignUp(cluster_bytes, draw_data_alignment);
+        GrowStreamBuffer(light_stream, 1, index_offset + index_bytes, "Light cluster buffer");
+
+        uint8_t* region = light_stream.BeginRegion();
+        const void* data[3] = { lights.data(), clusters.data(), indices.data() };
+        uint64_t offsets[3] = { light_offset, cluster_offset, index_offset };
+        uint64_t sizes[3] = { sizeof(PointLight) * lights.size(), cluster_bytes, sizeof(uint32_t) * indices.size() };
+        for (int i = 0; i < 3; i++)
+        {
+            if (!sizes[i]) continue;
+            if (region) memcpy(region + offsets[i], data[i], sizes[i]);
+            else glNamedBufferSubData(light_stream.buffer_object, light_stream.RegionOffset() + offsets[i], sizes[i], data[i]);
+        }
+        gl_state.BindShaderStorageRange(1, light_stream.buffer_object, light_stream.RegionOffset() + light_offset, light_bytes);
+        gl_state.BindShaderStorageRange(2, light_stream.buffer_object, light_stream.RegionOffset() + cluster_offset, cluster_bytes);
+        gl_state.BindShaderStorageRange(3, light_stream.buffer_object, light_stream.RegionOffset() + index_offset, index_bytes);
+    }
+};
+
+LightClusterGrid light_grid;
+
+/*
+    延迟着色：几何阶段把反照率与自发光标记、八面体编码的观察空间法线写入 G-buffer，
+    光照阶段用一个覆盖全屏的三角形对每个像素计算一次光照，位置由深度重建。
+    每像素 12 字节：RGBA8 反照率，RG16_SNORM 法线，32 位浮点深度。
+*/
+enum RenderPath
+{
+    RENDER_PATH_FORWARD,
+    RENDER_PATH_DEFERRED,
+    RENDER_PATH_COUNT
+};
+
+const char* RENDER_PATH_NAMES[RENDER_PATH_COUNT] = { "forward", "deferred" };
+
+int render_path = RENDER_PATH_FORWARD;
+
+uint32_t gbuffer_program_object;
+/* 光照变体可用之前，前向路径使用的简化程序 */
+uint32_t fallback_program_object;
+/* 自发光物体只输出自身的颜色；在 G-buffer 中写入的 alpha 为 1，作为自发光标记 */
+uint32_t emissive_program_object;
+
+/* 延迟着色几何阶段的用时，光照阶段与前向着色的主渲染阶段一样由 main_pass_timer 统计 */
+GPUTimer gbuffer_timer;
+
+struct GBuffer
+{
+    uint32_t albedo, normal, depth;
+    uint32_t framebuffer;
+    int32_t width = 0, height = 0;
+
+    /* 窗口大小改变时重新创建 */
+    void Resize(int32_t _width, int32_t _height)
+    {
+        if (_width == width && _height == height) return;
+        if (width)
+        {
+            glDeleteFramebuffers(1, &framebuffer);
+            glDeleteTextures(1, &albedo);
+            glDeleteTextures(1, &normal);
+            glDeleteTextures(1, &depth);
+            gl_state.Invalidate();
+        }
+        width = _width;
+        height = _height;
+        const uint32_t formats[3] = { GL_RGBA8, GL_RG16_SNORM, GL_DEPTH_COMPONENT32F };
+        uint32_t* textures[3] = { &albedo, &normal, &depth };
+        for (int i = 0; i < 3; i++)
+        {
+            glCreateTextures(GL_TEXTURE_2D, 1, textures[i]);
+            glTextureStorage2D(*textures[i], 1, formats[i], width, height);
+            glTextureParameteri(*textures[i], GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTextureParameteri(*textures[i], GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+        glCreateFramebuffers(1, &framebuffer);
+        glNamedFramebufferTexture(framebuffer, GL_COLOR_ATTACHMENT0, albedo, 0);
+        glNamedFramebufferTexture(framebuffer, GL_COLOR_ATTACHMENT1, normal, 0);
+        glNamedFramebufferTexture(framebuffer, GL_DEPTH_ATTACHMENT, depth, 0);
+        const uint32_t draw_buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glNamedFramebufferDrawBuffers(framebuffer, 2, draw_buffers);
+        std::cout << "G-buffer: " << width << "x" << height << ", " << width * height * 12 / 1048576.0 << "MB" << std::endl;
+    }
+};
+
+GBuffer gbuffer;
+
+/*
+    深度预渲染：前向路径先只写深度，着色阶段用 GL_EQUAL 比较，每个像素只对最终可见的片段运行光照着色器。
+    预渲染要多绘制一遍场景几何，重叠较少时得不偿失。着色阶段的片段数由 GL_FRAGMENT_SHADER_INVOCATIONS
+    统计，除以像素数就是平均每个像素着色的片段数(重叠程度)。AUTO 模式在重叠程度超过
+    DEPTH_PREPASS_OVERDRAW_THRESHOLD 时开启预渲染；开启后着色阶段的片段数不再反映重叠程度，
+    每隔 DEPTH_PREPASS_PROBE_FRAMES 帧关闭一帧重新测量。延迟路径的光照阶段本来就逐像素计算，不使用预渲染。
+*/
+enum DepthPrepassMode { DEPTH_PREPASS_OFF, DEPTH_PREPASS_ON, DEPTH_PREPASS_AUTO, DEPTH_PREPASS_MODE_COUNT };
+const char* DEPTH_PREPASS_MODE_NAMES[DEPTH_PREPASS_MODE_COUNT] = { "off", "on", "auto" };
+const double DEPTH_PREPASS_OVERDRAW_THRESHOLD = 1.5;
+const int DEPTH_PREPASS_PROBE_FRAMES = 120;
+
+uint32_t prepass_program_object;
+GPUTimer prepass_timer;
+
+struct DepthPrepass
+{
+    int mode = DEPTH_PREPASS_AUTO;
+    bool enabled = false;
+    int frame = 0;
+
+    /* 与 GPUTimer 一样轮流使用几个查询，结果可用时再读取 */
+    uint32_t queries[GPU_TIMER_QUERIES];
+    bool pending[GPU_TIMER_QUERIES];
+    bool with_prepass[GPU_TIMER_QUERIES];
+    uint64_t pixels[GPU_TIMER_QUERIES];
+    int next = 0;
+    bool active = false;
+    /* 最近一次测得的每像素着色片段数，以及最近一次不使用预渲染时测得的值(重叠程度) */
+    double shaded_per_pixel = 0.0;
+    double overdraw = 0.0;
+
+    void Create()
+    {
+        glCreateQueries(GL_FRAGMENT_SHADER_INVOCATIONS, GPU_TIMER_QUERIES, queries);
+        for (int i = 0; i < GPU_TIMER_QUERIES; i++) pending[i] = false;
+    }
+
+    /* 决定本帧是否使用预渲染 */
+    bool Active()
+    {
+        frame++;
+        if (mode != DEPTH_PREPASS_AUTO) return mode == DEPTH_PREPASS_ON;
+        return enabled && frame % DEPTH_PREPASS_PROBE_FRAMES != 0;
+    }
+
+    void Poll()
+    {
+        for (int i = 0; i < GPU_TIMER_QUERIES; i++)
+        {
+            if (!pending[i]) continue;
+            int32_t available = 0;
+            glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) continue;
+            uint64_t invocations = 0;
+            glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &invocations);
+            pending[i] = false;
+            shaded_per_pixel = (double)invocations / pixels[i];
+            if (with_prepass[i]) continue;
+            overdraw = shaded_per_pixel;
+            if (mode == DEPTH_PREPASS_AUTO && enabled != (overdraw > DEPTH_PREPASS_OVERDRAW_THRESHOLD))
+            {
+                enabled = !enabled;
+                std::cout << "Depth pre-pass " << (enabled ? "enabled" : "disabled") << " (overdraw: " << overdraw << ")" << std::endl;
+            }
+        }
+    }
+
+    /* 统计着色阶段的片段数，所有查询都在等待结果时跳过本次测量 */
+    void Begin(int width, int height, bool prepass)
+    {
+        Poll();
+        if (pending[next]) return;
+        glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS, queries[next]);
+        pixels[next] = (uint64_t)std::max(width, 1) * std::max(height, 1);
+        with_prepass[next] = prepass;
+        active = true;
+    }
+
+    void End()
+    {
+        if (!active) return;
+        glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS);
+        pending[next] = true;
+        next = (next + 1) % GPU_TIMER_QUERIES;
+        active = false;
+    }
+};
+
+DepthPrepass depth_prepass;
+
+/*
+    每帧的常量，布局与着色器中的 FrameConstantBlock (std140) 一致。
+    每帧填写一次，写入流式缓冲区的下一个区域，以 glBindBufferRange 绑定到 uniform 缓冲区绑定点 0，
+    所有使用这些常量的程序共享同一份数据。
+*/
+struct FrameConstants
+{
+    Matrix mat_proj;
+    Matrix mat_trans;
+    Matrix mat_view_inverse;
+    Matrix mat_depth[MAX_SHADOW_CASCADES];
+    float cascade_rect[MAX_SHADOW_CASCADES][4];
+    float cascade_far[MAX_SHADOW_CASCADES];
+    float cascade_penumbra[MAX_SHADOW_CASCADES];
+    float light_direction[4];
+    float proj_params[4];
+    int32_t cluster_grid[4];
+    float cluster_tile_scale[2];
+    float cluster_depth_params[2];
+    float viewport_size[2];
+    float evsm_exponents[2];
+    int32_t cascade_count;
+    float shadow_filter_radius;
+    float shadow_bleed_reduction;
+    float shadow_min_variance;
+    float Kq, Kp, Kc;
+    float padding;
+};
+
+static_assert(MAX_SHADOW_CASCADES == 4, "cascade_far and cascade_penumbra are packed into one vec4 each");
+static_assert(sizeof(FrameConstants) == 656, "FrameConstants must match the std140 layout of FrameConstantBlock");
+
+/* uniform 缓冲区的区域大小，向上取整到 GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT 的倍数，由 InitBufferAlignments 设置 */
+uint64_t frame_constants_region_size = AlignUp(sizeof(FrameConstants), 256);
+
+/*
+    查询实现的 SSBO 与 UBO 偏移对齐要求。流式缓冲区的区域大小也取对齐的倍数，
+    这样每个区域的起始偏移都满足要求，扩容时按两倍增长仍然是倍数。
+*/
+void InitBufferAlignments()
+{
+    int32_t ssbo_alignment = 0, ubo_alignment = 0;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssbo_alignment);
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_alignment);
+    draw_data_alignment = std::max(ssbo_alignment, 1);
+    frame_constants_region_size = AlignUp(sizeof(FrameConstants), std::max(ubo_alignment, 1));
+}
+
+StreamBuffer frame_constant_stream;
+FrameConstants frame_constants;
+
+void UploadFrameConstants()
+{
+    uint8_t* region = frame_constant_stream.BeginRegion();
+    if (region) memcpy(region, &frame_constants, sizeof(FrameConstants));
+    else glNamedBufferSubData(frame_constant_stream.buffer_object, frame_constant_stream.RegionOffset(), sizeof(FrameConstants), &frame_constants);
+    gl_state.BindUniformRange(0, frame_constant_stream.buffer_object, frame_constant_stream.RegionOffset(), sizeof(FrameConstants));
+}
+
+/*
+    光照着色器的变体：阴影过滤方式、采样数、网格半径与漫反射模型以宏的形式注入 lighting.glsl，
+    每种组合对应一个特性位掩码，首次使用时编译并缓存。
+    位 0-2 为过滤方式，位 3-4 为采样数 (4 << n)，位 5-8 为网格半径，位 9 为 Disney 漫反射。
+    与当前过滤方式无关的位保持为 0，不会编译出内容相同的变体。
+*/
+enum ShaderFeature
+{
+    SHADER_FEATURE_FILTER_SHIFT = 0,
+    SHADER_FEATURE_TAPS_SHIFT = 3,
+    SHADER_FEATURE_GRID_SHIFT = 5,
+    SHADER_FEATURE_DISNEY_DIFFUSE = 1 << 9
+};
+
+bool disney_diffuse = false;
+
+uint32_t LightingFeatures()
+{
+    uint32_t features = shadow_filter.mode << SHADER_FEATURE_FILTER_SHIFT;
+    if (shadow_filter.mode == SHADOW_FILTER_POISSON || shadow_filter.mode == SHADOW_FILTER_PCSS)
+    {
+        uint32_t n = 0;
+        while (n < 3 && (4 << n) < shadow_filter.taps) n++;
+        features |= n << SHADER_FEATURE_TAPS_SHIFT;
+    }
+    if (shadow_filter.mode == SHADOW_FILTER_GRID) features |= shadow_filter.grid_radius << SHADER_FEATURE_GRID_SHIFT;
+    if (disney_diffuse) features |= SHADER_FEATURE_DISNEY_DIFFUSE;
+    return features;
+}
+
+std::string LightingDefines(uint32_t features)
+{
+    std::string defines;
+    defines += "#define SHADOW_FILTER_MODE " + std::to_string((features >> SHADER_FEATURE_FILTER_SHIFT) & 7) + "\n";
+    defines += "#define SHADOW_FILTER_TAPS " + std::to_string(4 << ((features >> SHADER_FEATURE_TAPS_SHIFT) & 3)) + "\n";
+    defines += "#define SHADOW_GRID_RADIUS " + std::to_string((features >> SHADER_FEATURE_GRID_SHIFT) & 15) + "\n";
+    if (features & SHADER_FEATURE_DISNEY_DIFFUSE) defines += "#define DISNEY_DIFFUSE\n";
+    return defines;
+}
+
+/* 使用 lighting.glsl 的程序，分别与 RenderPath 对应 */
+/* 延迟光照阶段使用全屏三角形的顶点着色器 */
+const char* LIGHTING_VERTEX_SHADERS[RENDER_PATH_COUNT] = { "vertex_shader.glsl", "moments_vertex_shader.glsl" };
+const char* LIGHTING_FRAGMENT_SHADERS[RENDER_PATH_COUNT] = { "fragment_shader.glsl", "deferred_fragment_shader.glsl" };
+
+/* 程序启动的时刻，用于统计首帧时间与完整着色可用的时间 */
+std::chrono::steady_clock::time_point startup_time;
+
+struct ShaderVariantCache
+{
+    std::unordered_map<uint64_t, std::unique_ptr<AsyncProgram>> programs;
+    /* 每种渲染路径最近一个可用的变体，新变体编译完成之前继续使用 */
+    uint32_t last_ready[RENDER_PATH_COUNT] = {};
+    uint32_t ready = 0;
+    /* 所有变体都完成后输出一次程序缓存的统计，之后有新的变体时再次输出 */
+    bool cache_reported = false;
+
+    /* 读取线程可能仍持有请求的指针，先让它退出再释放 */
+    ~ShaderVariantCache() { shader_loader.Stop(); }
+
+    /* 变体可用时返回该程序；否则开始创建，wait 为 true 时等待其完成，为 false 时返回 last_ready 中的程序(可能为 0) */
+    uint32_t Get(int path, uint32_t features, bool wait = false)
+    {
+        uint64_t key = ((uint64_t)path << 32) | features;
+        std::unordered_map<uint64_t, std::unique_ptr<AsyncProgram>>::iterator it = programs.find(key);
+        AsyncProgram* request;
+        if (it == programs.end())
+        {
+            request = new AsyncProgram(LIGHTING_VERTEX_SHADERS[path], LIGHTING_FRAGMENT_SHADERS[path], LightingDefines(features));
+            programs[key].reset(request);
+            cache_reported = false;
+            shader_loader.Submit(request);
+            /* 程序缓存命中时第一次推进就会完成 */
+            request->Advance();
+            if (request->Finished()) Completed(key, request);
+        }
+        else
+            request = it->second.get();
+        if (!request->Finished() && (wait || !ASYNC_SHADER_COMPILATION))
+        {
+            request->Wait();
+            Completed(key, request);
+        }
+        if (request->state == AsyncProgram::READY) last_ready[path] = request->program;
+        return request->state == AsyncProgram::READY ? request->program : last_ready[path];
+    }
+
+    /* 每帧调用一次，推进所有未完成的变体，全部完成后输出程序缓存的统计 */
+    void Poll()
+    {
+        for (std::unordered_map<uint64_t, std::unique_ptr<AsyncProgram>>::iterator it = programs.begin(); it != programs.end(); it++)
+        {
+            if (it->second->Finished()) continue;
+            it->second->Advance();
+            if (it->second->Finished()) Completed(it->first, it->second.get());
+        }
+        if (cache_reported) return;
+        for (std::unordered_map<uint64_t, std::unique_ptr<AsyncProgram>>::iterator it = programs.begin(); it != programs.end(); it++)
+            if (!it->second->Finished()) return;
+        program_cache.Report();
+        cache_reported = true;
     }
-    return shader_object;
-}
 
-uint32_t LinkProgram(uint32_t vs_object, uint32_t fs_object)
-{
-    uint32_t program_object = glCreateProgram();
-    glAttachShader(program_object, vs_object);
-    glAttachShader(program_object, fs_object);
-    glLinkProgram(program_object);
-    int32_t link_success;
-    glGetProgramiv(program_object, GL_LINK_STATUS, &link_success);
-    if (!link_success)
+    void Completed(uint64_t key, const AsyncProgram* request)
     {
-        int32_t log_length;
-        glGetProgramiv(program_object, GL_INFO_LOG_LENGTH, &log_length);
-        char * error_info = new char [log_length + 1];
-        glGetProgramInfoLog(program_object, log_length + 1, &log_length, error_info);
-        std::cout << error_info << std::endl;
-        glDeleteProgram(program_object);
-        delete[] error_info;
-        return 0;
+        if (request->state == AsyncProgram::READY) ready++;
+        std::cout << RENDER_PATH_NAMES[key >> 32] << " shader variant 0x" << std::hex << (uint32_t)key << std::dec
+            << (request->state == AsyncProgram::READY ? " ready" : " failed") << " after " << request->ready_ms << "ms ("
+            << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startup_time).count()
+            << "ms since startup, " << ready << "/" << programs.size() << " variants ready)" << std::endl;
     }
-    return program_object;
-}
+};
+
+ShaderVariantCache shader_variants;
 
 /* 这个函数用于初始化渲染过程中用到的资源 */
 void InitAssets()
@@ -279,90 +2827,183 @@ void InitAssets()
         sphere_indices[(BALL_ACCURACY - 2) * BALL_ACCURACY * 2 + j * 2 + 1] = TriInd(0, j + 2, next_j + 2);
     }
 
-    glCreateBuffers(1, &vertex_buffer_object);
-    glNamedBufferData(vertex_buffer_object, sizeof(vertex_buffer), nullptr, GL_DYNAMIC_DRAW);
-
-    glCreateBuffers(1, &index_buffer_object);
-    glNamedBufferData(index_buffer_object, sizeof(index_buffer), nullptr, GL_DYNAMIC_DRAW);
+    InitStaticGeometry();
+    occlusion_buffer.Init();
+    vertex_stream.Create(geometry.static_vertices.data(), sizeof(Vertex) * geometry.static_vertices.size(), 65536 * sizeof(Vertex));
+    index_stream.Create(geometry.static_indices.data(), sizeof(TriInd) * geometry.static_indices.size(), 65536 * sizeof(TriInd));
+    indirect_stream.Create(nullptr, 0, 16384);
+    InitBufferAlignments();
+    draw_data_stream.Create(nullptr, 0, AlignUp(16384, draw_data_alignment));
+    light_stream.Create(nullptr, 0, AlignUp(65536, draw_data_alignment));
+    frame_constant_stream.Create(nullptr, 0, frame_constants_region_size);
+
+
+    program_cache.Init();
+    InitParallelShaderCompile();
+    shader_loader.Start();
+    /* 光照变体先提交，在后台编译，其余程序较小，同步创建 */
+    shader_variants.Get(RENDER_PATH_FORWARD, LightingFeatures());
+    fallback_program_object = LoadProgram("vertex_shader.glsl", "fallback_fragment_shader.glsl");
+    gbuffer_program_object = LoadProgram("vertex_shader.glsl", "gbuffer_fragment_shader.glsl");
+    emissive_program_object = LoadProgram("emissive_vertex_shader.glsl", "emissive_fragment_shader.glsl");
+    prepass_program_object = LoadProgram("prepass_vertex_shader.glsl", "depth_fragment_shader.glsl");
+    depth_shader_program_object = LoadProgram("depth_vertex_shader.glsl", "depth_fragment_shader.glsl");
+    depth_mat_trans_location = glGetUniformLocation(depth_shader_program_object, "mat_trans");
+    tex_shader_program_object = LoadProgram("tex_vertex_shader.glsl", "tex_fragment_shader.glsl");
 
 
-    uint32_t vertex_shader_object = CompileGLSLShaderFromFile("vertex_shader.glsl", GL_VERTEX_SHADER);
-    uint32_t fragment_shader_object = CompileGLSLShaderFromFile("fragment_shader.glsl", GL_FRAGMENT_SHADER);
+    InitShadowAtlasLayout();
+    CreateShadowMapTarget(depth_map_object, depth_map_framebuffer_object);
+    if (SHADOW_CACHE) CreateShadowMapTarget(shadow_cache.texture, shadow_cache.framebuffer);
+    shadow_timer.Create(2);
+    moments_timer.Create(1);
+    main_pass_timer.Create(SHADOW_BENCHMARK_CONFIG_COUNT + 1);
+    gbuffer_timer.Create(1);
+    prepass_timer.Create(1);
+    depth_prepass.Create();
+    CreateShadowSamplers();
 
-    shader_program_object = LinkProgram(vertex_shader_object, fragment_shader_object);
-    glDeleteShader(vertex_shader_object);
-    glDeleteShader(fragment_shader_object);
+}
 
-    vertex_shader_object = CompileGLSLShaderFromFile("depth_vertex_shader.glsl", GL_VERTEX_SHADER);
-    fragment_shader_object = CompileGLSLShaderFromFile("depth_fragment_shader.glsl", GL_FRAGMENT_SHADER);
-    depth_shader_program_object = LinkProgram(vertex_shader_object, fragment_shader_object);
-    glDeleteShader(vertex_shader_object);
-    glDeleteShader(fragment_shader_object);
+void ResetScene()
+{
+    vertex_buffer.Reset();
+    index_buffer.Reset();
+}
 
-    vertex_shader_object = CompileGLSLShaderFromFile("tex_vertex_shader.glsl", GL_VERTEX_SHADER);
-    fragment_shader_object = CompileGLSLShaderFromFile("tex_fragment_shader.glsl", GL_FRAGMENT_SHADER);
-    tex_shader_program_object = LinkProgram(vertex_shader_object, fragment_shader_object);
-    glDeleteShader(vertex_shader_object);
-    glDeleteShader(fragment_shader_object);
+/* 载入静态批次中的三角形，颜色相同的连续三角形归入同一个静态物体 */
+void LoadTriangle(Vec3f v0, Vec3f v1, Vec3f v2, Vec3f color)
+{
+    uint32_t first_vertex, first_index;
+    if (!AllocateGeometry(3, 1, first_vertex, first_index)) return;
+    Vec3f normal = normalize(cross(v1 - v0, v2 - v0));
+    vertex_buffer[first_vertex].pos = v0;
+    vertex_buffer[first_vertex].normal = normal;
+    vertex_buffer[first_vertex + 1].pos = v1;
+    vertex_buffer[first_vertex + 1].normal = normal;
+    vertex_buffer[first_vertex + 2].pos = v2;
+    vertex_buffer[first_vertex + 2].normal = normal;
+    index_buffer[first_index] = TriInd(first_vertex, first_vertex + 2, first_vertex + 1);
+
+    std::vector<StaticObject>& objects = geometry.static_objects;
+    if (!objects.empty() && objects.back().color == color && objects.back().first_index + objects.back().triangle_count == first_index)
+        objects.back().triangle_count++;
+    else
+    {
+        StaticObject object;
+        object.first_index = first_index;
+        object.triangle_count = 1;
+        object.color = color;
+        objects.push_back(object);
+    }
+}
 
+/* 本帧需要生成的动态物体 */
+struct SceneObject
+{
+    uint32_t object;
+    Vec3f origin;
+    float radius;
+    Vec3f color;
+    bool emissive;
+    uint32_t vertex_count, triangle_count;
+    uint32_t first_vertex, first_index;
+    bool write;
+};
 
-    glCreateTextures(GL_TEXTURE_2D, 1, &depth_map_object);
-    glBindTexture(GL_TEXTURE_2D, depth_map_object);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    glBindTexture(GL_TEXTURE_2D, 0);
+std::vector<SceneObject> scene_objects;
 
-    glCreateFramebuffers(1, &depth_map_framebuffer_object);
-    glBindFramebuffer(GL_FRAMEBUFFER, depth_map_framebuffer_object);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_map_object, 0);
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+/* 是否在线程池中并行展开动态物体，关闭时在当前线程中按顺序展开，两者结果完全相同 */
+const bool PARALLEL_SCENE_ASSEMBLY = true;
 
+/* object 为动态物体的编号，只记录生成参数，实际的顶点数据在 ExpandSceneObjects 中生成 */
+void LoadSphere(uint32_t object, Vec3f origin, float radius, Vec3f color, bool emissive = false)
+{
+    SceneObject scene_object;
+    scene_object.object = object;
+    scene_object.origin = origin;
+    scene_object.radius = radius;
+    scene_object.color = color;
+    scene_object.emissive = emissive;
+    scene_object.vertex_count = BALL_ACCURACY * (BALL_ACCURACY - 1) + 2;
+    scene_object.triangle_count = BALL_ACCURACY * (BALL_ACCURACY - 1) * 2;
+    scene_object.write = false;
+    scene_objects.push_back(scene_object);
 }
 
-void ResetScene()
+void WriteSphere(const SceneObject& sphere)
 {
-    cnt_index = 0;
-    cnt_vertex = 0;
+    for (int i = 0; i < BALL_ACCURACY*(BALL_ACCURACY - 1)+2; i++)
+    {
+        vertex_buffer[i+sphere.first_vertex].pos = sphere_vertices[i] * sphere.radius + sphere.origin;
+        vertex_buffer[i+sphere.first_vertex].normal = sphere_vertices[i];
+    }
+    for (int i = 0; i < BALL_ACCURACY * (BALL_ACCURACY - 1) *2; i++)
+        index_buffer[i + sphere.first_index] = sphere_indices[i] + sphere.first_vertex;
 }
 
-void LoadTriangle(Vec3f v0, Vec3f v1, Vec3f v2, Vec3f color)
+/*
+    第一阶段：对物体的顶点数与三角形数做前缀和，一次性为所有物体分配互不重叠的区间，
+    然后按顺序判断哪些物体需要重新生成并记录脏区间。
+*/
+void ReserveSceneObjects()
 {
-    Vec3f normal = normalize(cross(v1 - v0, v2 - v0));
-    vertex_buffer[cnt_vertex].pos = v0;
-    vertex_buffer[cnt_vertex].normal = normal;
-    vertex_buffer[cnt_vertex].color = color;
-    vertex_buffer[cnt_vertex].flag = 0;
-    vertex_buffer[cnt_vertex + 1].pos = v1;
-    vertex_buffer[cnt_vertex + 1].normal = normal;
-    vertex_buffer[cnt_vertex + 1].color = color;
-    vertex_buffer[cnt_vertex + 1].flag = 0;
-    vertex_buffer[cnt_vertex + 2].pos = v2;
-    vertex_buffer[cnt_vertex + 2].normal = normal;
-    vertex_buffer[cnt_vertex + 2].color = color;
-    vertex_buffer[cnt_vertex + 2].flag = 0;
-    index_buffer[cnt_index] = TriInd(cnt_vertex, cnt_vertex + 2, cnt_vertex + 1);
-    cnt_vertex += 3;
-    cnt_index += 1;
-}
-
-void LoadSphere(Vec3f origin, float radius, Vec3f color, float flag = 0.0)
+    uint32_t total_vertices = 0, total_triangles = 0;
+    for (size_t i = 0; i < scene_objects.size(); i++)
+    {
+        scene_objects[i].first_vertex = total_vertices;
+        scene_objects[i].first_index = total_triangles;
+        total_vertices += scene_objects[i].vertex_count;
+        total_triangles += scene_objects[i].triangle_count;
+    }
+
+    uint32_t base_vertex, base_index;
+    if (!AllocateGeometry(total_vertices, total_triangles, base_vertex, base_index))
+    {
+        scene_objects.clear();
+        return;
+    }
+
+    for (size_t i = 0; i < scene_objects.size(); i++)
+    {
+        SceneObject& scene_object = scene_objects[i];
+        scene_object.first_vertex += base_vertex;
+        scene_object.first_index += base_index;
+
+        if (scene_object.object >= geometry.dynamic_objects.size()) geometry.dynamic_objects.resize(scene_object.object + 1);
+        DynamicObject& record = geometry.dynamic_objects[scene_object.object];
+        if (record.first_vertex != scene_object.first_vertex || record.first_index != scene_object.first_index ||
+            !(record.origin == scene_object.origin) || record.radius != scene_object.radius)
+        {
+            record.origin = scene_object.origin;
+            record.radius = scene_object.radius;
+            record.first_vertex = scene_object.first_vertex;
+            record.first_index = scene_object.first_index;
+            record.last_change_frame = geometry.frame;
+        }
+        else if (geometry.frame - record.last_change_frame >= vertex_stream.regions)
+            continue;
+
+        scene_object.write = true;
+        AddDirtyRange(geometry.vertex_dirty, sizeof(Vertex) * scene_object.first_vertex, sizeof(Vertex) * (scene_object.first_vertex + scene_object.vertex_count));
+        AddDirtyRange(geometry.index_dirty, sizeof(TriInd) * scene_object.first_index, sizeof(TriInd) * (scene_object.first_index + scene_object.triangle_count));
+    }
+}
+
+/* 第二阶段：并行展开需要重新生成的物体，各物体只写入自己的区间，因此结果与串行展开相同 */
+void ExpandSceneObjects()
 {
-    for (int i = 0; i < BALL_ACCURACY*(BALL_ACCURACY - 1)+2; i++)
+    if (!PARALLEL_SCENE_ASSEMBLY)
     {
-        vertex_buffer[i+cnt_vertex].pos = sphere_vertices[i] * radius + origin;
-        vertex_buffer[i+cnt_vertex].normal = sphere_vertices[i];
-        vertex_buffer[i+cnt_vertex].color = color;
-        vertex_buffer[i+cnt_vertex].flag = flag;
+        for (size_t i = 0; i < scene_objects.size(); i++)
+            if (scene_objects[i].write) WriteSphere(scene_objects[i]);
+        return;
     }
-    for (int i = 0; i < BALL_ACCURACY * (BALL_ACCURACY - 1) *2; i++)
-        index_buffer[i + cnt_index] = sphere_indices[i] + cnt_vertex;
-    cnt_vertex += BALL_ACCURACY * (BALL_ACCURACY - 1) + 2;
-    cnt_index += BALL_ACCURACY * (BALL_ACCURACY - 1) * 2;
+    thread_pool.ParallelFor(scene_objects.size(), 4, [](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t i = begin; i < end; i++)
+            if (scene_objects[i].write) WriteSphere(scene_objects[i]);
+    });
 }
 
 Vec3f balls_pos[64];
@@ -439,36 +3080,439 @@ void UpdateBalls(float time_step)
         balls_pos[i] = balls_pos[i] + balls_velocity[i] * time_step;
 }
 
-void LoadScene()
+/* 为 true 时所有球都作为点光源，否则只有对角线上的 8 个球发光 */
+bool all_balls_emit_light = false;
+
+bool BallEmitsLight(int i)
 {
-    ResetScene();
+    return all_balls_emit_light || (i & 7) == (i >> 3);
+}
+
+/* 把发光的球加入点光源列表，位置变换到观察空间 */
+void GatherBallLights(const Matrix& mat_trans, std::vector<PointLight>& lights)
+{
+    lights.clear();
+    for (int i = 0; i < 64; i++)
+    {
+        if (!BallEmitsLight(i)) continue;
+        float clip[4];
+        TransformClip(mat_trans, balls_pos[i], clip);
+        PointLight light;
+        light.position = Vec3f(clip[0], clip[1], clip[2]);
+        light.color = balls_color[i] * POINT_LIGHT_INTENSITY;
+        light.range = LightRange(light.color);
+        light.padding = 0.0f;
+        lights.push_back(light);
+    }
+}
+
+/* 顶点焊接容差，位置、法线、颜色各分量之差均不超过该值的顶点视为同一个顶点 */
+const float WELD_EPSILON = 1e-5f;
+
+/* 静态批次焊接前后的顶点数，用于统计输出 */
+uint32_t static_vertices_before_weld, static_vertices_after_weld;
+
+bool VertexNearlyEqual(const Vertex& a, const Vertex& b)
+{
+    const float* fa = (const float*)&a;
+    const float* fb = (const float*)&b;
+    for (size_t i = 0; i < sizeof(Vertex) / sizeof(float); i++)
+        if (fabsf(fa[i] - fb[i]) > WELD_EPSILON) return false;
+    return true;
+}
+
+uint64_t WeldCellKey(int64_t x, int64_t y, int64_t z)
+{
+    return ((uint64_t)x * 73856093u) ^ ((uint64_t)y * 19349663u) ^ ((uint64_t)z * 83492791u);
+}
+
+/*
+    将 vertex_buffer[vertex_begin, count) 中相同的顶点合并，并重写 index_buffer[index_begin, count) 中的索引。
+    顶点按位置量化到边长为 WELD_EPSILON 的网格中进行哈希，查找时检查相邻的 27 个格子，
+    因此恰好落在格子边界两侧的近似相等顶点也能被合并。合并后的顶点保持首次出现的顺序。
+    返回合并后的顶点数。
+*/
+uint32_t WeldVertices(uint32_t vertex_begin, uint32_t index_begin)
+{
+    uint32_t vertex_count = vertex_buffer.count - vertex_begin;
+    std::unordered_map<uint64_t, uint32_t> cell_head;
+    std::vector<uint32_t> cell_next;
+    std::vector<uint32_t> remap(vertex_count);
+    cell_head.reserve(vertex_count);
+    cell_next.reserve(vertex_count);
+
+    uint32_t welded_count = 0;
+    for (uint32_t i = 0; i < vertex_count; i++)
+    {
+        const Vertex& v = vertex_buffer[vertex_begin + i];
+        int64_t cx = (int64_t)floorf(v.pos.x / WELD_EPSILON);
+        int64_t cy = (int64_t)floorf(v.pos.y / WELD_EPSILON);
+        int64_t cz = (int64_t)floorf(v.pos.z / WELD_EPSILON);
+
+        uint32_t found = UINT32_MAX;
+        for (int dx = -1; dx <= 1 && found == UINT32_MAX; dx++)
+            for (int dy = -1; dy <= 1 && found == UINT32_MAX; dy++)
+                for (int dz = -1; dz <= 1 && found == UINT32_MAX; dz++)
+                {
+                    auto it = cell_head.find(WeldCellKey(cx + dx, cy + dy, cz + dz));
+                    if (it == cell_head.end()) continue;
+                    for (uint32_t j = it->second; j != UINT32_MAX; j = cell_next[j])
+                        if (VertexNearlyEqual(vertex_buffer[vertex_begin + j], v))
+                        {
+                            found = j;
+                            break;
+                        }
+                }
+
+        if (found == UINT32_MAX)
+        {
+            found = welded_count++;
+            vertex_buffer[vertex_begin + found] = v;
+            uint64_t key = WeldCellKey(cx, cy, cz);
+            auto it = cell_head.find(key);
+            cell_next.push_back(it == cell_head.end() ? UINT32_MAX : it->second);
+            cell_head[key] = found;
+        }
+        remap[i] = found;
+    }
 
+    for (uint32_t i = index_begin; i < index_buffer.count; i++)
+    {
+        index_buffer[i].i0 = vertex_begin + remap[index_buffer[i].i0 - vertex_begin];
+        index_buffer[i].i1 = vertex_begin + remap[index_buffer[i].i1 - vertex_begin];
+        index_buffer[i].i2 = vertex_begin + remap[index_buffer[i].i2 - vertex_begin];
+    }
+    vertex_buffer.count = vertex_begin + welded_count;
+    return welded_count;
+}
+
+/* 静态批次载入完毕后调用，合并批次内的重复顶点，并在顶点数变化时输出统计 */
+void FinalizeStaticBatch(uint32_t vertex_begin, uint32_t index_begin)
+{
+    uint32_t before = vertex_buffer.count - vertex_begin;
+    uint32_t after = WeldVertices(vertex_begin, index_begin);
+    if (before != static_vertices_before_weld || after != static_vertices_after_weld)
+    {
+        static_vertices_before_weld = before;
+        static_vertices_after_weld = after;
+        printf("Static batch welded: %u -> %u vertices (-%.1f%%)\n", before, after, before ? 100.0 * (before - after) / before : 0.0);
+    }
+}
+
+/* 载入房间的墙壁，墙壁在整个运行过程中保持不变。相同颜色的墙壁连续载入，以便合并为一个静态物体 */
+void LoadRoom()
+{
     LoadTriangle(Vec3f(5.0, -5.0, 5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(-5.0, -5.0, 5.0), Vec3f(0.7, 0.7, 1.0));
     LoadTriangle(Vec3f(5.0, -5.0, 5.0), Vec3f(5.0, -5.0, -5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(0.7, 0.7, 1.0));
-    LoadTriangle(Vec3f(5.0, 5.0, 5.0), Vec3f(-5.0, -5.0, 5.0), Vec3f(-5.0, 5.0, 5.0), Vec3f(0.7, 1.0, 0.7));
-    LoadTriangle(Vec3f(5.0, 5.0, 5.0), Vec3f(5.0, -5.0, 5.0), Vec3f(-5.0, -5.0, 5.0), Vec3f(0.7, 1.0, 0.7));
-    LoadTriangle(Vec3f(-5.0, 5.0, 5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(-5.0, 5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
-    LoadTriangle(Vec3f(-5.0, 5.0, 5.0), Vec3f(-5.0, -5.0, 5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
-
     LoadTriangle(Vec3f(-5.0, -5.0, -5.0), Vec3f(5.0, -5.0, 5.0), Vec3f(-5.0, -5.0, 5.0), Vec3f(0.7, 0.7, 1.0));
     LoadTriangle(Vec3f(5.0, -5.0, -5.0), Vec3f(5.0, -5.0, 5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(0.7, 0.7, 1.0));
-    LoadTriangle(Vec3f(-5.1, -5.0, 5.1), Vec3f(5.0, 5.0, 5.1), Vec3f(-5.1, 5.0, 5.1), Vec3f(0.7, 1.0, 0.7));
-    LoadTriangle(Vec3f(5.0, -5.0, 5.1), Vec3f(5.0, 5.0, 5.1), Vec3f(-5.1, -5.0, 5.1), Vec3f(0.7, 1.0, 0.7));
-    LoadTriangle(Vec3f(-5.1, -5.0, -5.0), Vec3f(-5.1, 5.0, 5.1), Vec3f(-5.1, 5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
-    LoadTriangle(Vec3f(-5.1, -5.0, 5.1), Vec3f(-5.1, 5.0, 5.1), Vec3f(-5.1, -5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
-
     LoadTriangle(Vec3f(-5.0, 5.0, -5.0), Vec3f(5.0, 5.0, 5.0), Vec3f(-5.0, 5.0, 5.0), Vec3f(0.7, 0.7, 1.0));
     LoadTriangle(Vec3f(5.0, 5.0, -5.0), Vec3f(5.0, 5.0, 5.0), Vec3f(-5.0, 5.0, -5.0), Vec3f(0.7, 0.7, 1.0));
+
+    LoadTriangle(Vec3f(5.0, 5.0, 5.0), Vec3f(-5.0, -5.0, 5.0), Vec3f(-5.0, 5.0, 5.0), Vec3f(0.7, 1.0, 0.7));
+    LoadTriangle(Vec3f(5.0, 5.0, 5.0), Vec3f(5.0, -5.0, 5.0), Vec3f(-5.0, -5.0, 5.0), Vec3f(0.7, 1.0, 0.7));
+    LoadTriangle(Vec3f(-5.1, -5.0, 5.1), Vec3f(5.0, 5.0, 5.1), Vec3f(-5.1, 5.0, 5.1), Vec3f(0.7, 1.0, 0.7));
+    LoadTriangle(Vec3f(5.0, -5.0, 5.1), Vec3f(5.0, 5.0, 5.1), Vec3f(-5.1, -5.0, 5.1), Vec3f(0.7, 1.0, 0.7));
     LoadTriangle(Vec3f(5.0, 5.0, -5.0), Vec3f(-5.0, 5.0, -5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(0.7, 1.0, 0.7));
     LoadTriangle(Vec3f(5.0, 5.0, -5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(5.0, -5.0, -5.0), Vec3f(0.7, 1.0, 0.7));
+
+    LoadTriangle(Vec3f(-5.0, 5.0, 5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(-5.0, 5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
+    LoadTriangle(Vec3f(-5.0, 5.0, 5.0), Vec3f(-5.0, -5.0, 5.0), Vec3f(-5.0, -5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
+    LoadTriangle(Vec3f(-5.1, -5.0, -5.0), Vec3f(-5.1, 5.0, 5.1), Vec3f(-5.1, 5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
+    LoadTriangle(Vec3f(-5.1, -5.0, 5.1), Vec3f(-5.1, 5.0, 5.1), Vec3f(-5.1, -5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
     LoadTriangle(Vec3f(5.0, -5.0, -5.0), Vec3f(5.0, 5.0, 5.0), Vec3f(5.0, 5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
     LoadTriangle(Vec3f(5.0, -5.0, 5.0), Vec3f(5.0, 5.0, 5.0), Vec3f(5.0, -5.0, -5.0), Vec3f(1.0, 0.7, 0.7));
+}
 
-    for (int i = 0; i < 64; i++)
-        LoadSphere(balls_pos[i], ball_radius, balls_color[i], ((i & 7) == (i >> 3)) ? 1.0f : 0.0);
-    
-    glNamedBufferSubData(vertex_buffer_object, 0, sizeof(Vertex) * cnt_vertex, vertex_buffer);
-    glNamedBufferSubData(index_buffer_object, 0, sizeof(TriInd) * cnt_index, index_buffer);
+DrawCommandList scene_draws;
+BoundingSphereSet scene_bounds;
+/* 物体编号不小于该值的都是自发光物体，BuildDrawCommands 把它们排在最后 */
+uint32_t first_emissive_object;
+
+/* 阴影与最终画面两个渲染过程各自的可见物体及绘制命令 */
+/* 阴影图的每个级联分别有静态与动态投影物两个列表，由 ShadowPass 计算编号 */
+/* 最终画面中受光照与自发光的物体分为两个列表，分别使用不同的程序绘制 */
+enum RenderPass { RENDER_PASS_MAIN, RENDER_PASS_EMISSIVE, RENDER_PASS_SHADOW, RENDER_PASS_COUNT = RENDER_PASS_SHADOW + MAX_SHADOW_CASCADES * 2 };
+int ShadowPass(int cascade, bool dynamic) { return RENDER_PASS_SHADOW + cascade * 2 + (dynamic ? 1 : 0); }
+DrawCommandList pass_draws[RENDER_PASS_COUNT];
+std::vector<uint32_t> pass_visible[RENDER_PASS_COUNT];
+
+/*
+    为每个物体生成一条绘制命令与包围球：静态物体的索引位于缓冲区开头，
+    动态物体的索引位于本帧的动态区域中，通过 base_vertex 指向本帧区域中的顶点。
+    先加入受光照的动态物体，再加入自发光的，使自发光物体的绘制命令连续排列；
+    几何数据仍按 LoadScene 的载入顺序存放，切换发光的球不会改变其位置。
+*/
+void BuildDrawCommands()
+{
+    scene_draws.Clear();
+    scene_bounds.Clear();
+    for (size_t i = 0; i < geometry.static_objects.size(); i++)
+    {
+        const StaticObject& object = geometry.static_objects[i];
+        scene_draws.Add(object.triangle_count * 3, object.first_index * 3, 0, object.color);
+        scene_bounds.Add(object.center, object.radius);
+    }
+    uint32_t region_first_index = index_stream.RegionOffset() / sizeof(uint32_t);
+    int32_t region_base_vertex = vertex_stream.RegionOffset() / sizeof(Vertex);
+    first_emissive_object = scene_draws.commands.size() + scene_objects.size();
+    for (int emissive = 0; emissive < 2; emissive++)
+    {
+        if (emissive) first_emissive_object = scene_draws.commands.size();
+        for (size_t i = 0; i < scene_objects.size(); i++)
+        {
+            const SceneObject& object = scene_objects[i];
+            if (object.emissive != (emissive != 0)) continue;
+            scene_draws.Add(object.triangle_count * 3, region_first_index + object.first_index * 3, region_base_vertex, object.color);
+            scene_bounds.Add(object.origin, object.radius);
+        }
+    }
+    scene_bounds.Pad();
+}
+
+/* 把背面剔除后的静态三角形与每个球的内接多面体作为遮挡物光栅化到遮挡深度图中 */
+void RenderOccluders(const Matrix& mat)
+{
+    OcclusionBuffer& buffer = occlusion_buffer;
+    size_t static_triangles = geometry.static_indices.size();
+    buffer.triangles.resize(static_triangles + scene_objects.size() * OCCLUDER_SPHERE_TRIANGLES);
+    for (size_t t = 0; t < static_triangles; t++)
+    {
+        const TriInd& triangle = geometry.static_indices[t];
+        float clip[3][4];
+        TransformClip(mat, geometry.static_vertices[triangle.i0].pos, clip[0]);
+        TransformClip(mat, geometry.static_vertices[triangle.i1].pos, clip[1]);
+        TransformClip(mat, geometry.static_vertices[triangle.i2].pos, clip[2]);
+        buffer.SetupTriangle(clip, true, buffer.triangles[t]);
+    }
+    thread_pool.ParallelFor(scene_objects.size(), 4, [&](uint32_t begin, uint32_t end)
+    {
+        std::vector<float> vertex_clip(buffer.sphere_vertices.size() * 4);
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const SceneObject& object = scene_objects[i];
+            Vec3f origin = object.origin;
+            for (size_t v = 0; v < buffer.sphere_vertices.size(); v++)
+                TransformClip(mat, origin + buffer.sphere_vertices[v] * object.radius, &vertex_clip[v * 4]);
+            for (int t = 0; t < OCCLUDER_SPHERE_TRIANGLES; t++)
+            {
+                const TriInd& triangle = buffer.sphere_triangles[t];
+                float clip[3][4];
+                memcpy(clip[0], &vertex_clip[triangle.i0 * 4], sizeof(clip[0]));
+                memcpy(clip[1], &vertex_clip[triangle.i1 * 4], sizeof(clip[1]));
+                memcpy(clip[2], &vertex_clip[triangle.i2 * 4], sizeof(clip[2]));
+                buffer.SetupTriangle(clip, false, buffer.triangles[static_triangles + i * OCCLUDER_SPHERE_TRIANGLES + t]);
+            }
+        }
+    });
+    buffer.Render();
+}
+
+/* 从 visible 中移除包围盒被遮挡的物体，包围盒取包围球的外接立方体 */
+void CullOccludedObjects(const Matrix& mat, std::vector<uint32_t>& visible)
+{
+    std::vector<uint8_t> occluded(visible.size());
+    thread_pool.ParallelFor(visible.size(), 16, [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            uint32_t object = visible[i];
+            Vec3f center(scene_bounds.x[object], scene_bounds.y[object], scene_bounds.z[object]);
+            Vec3f extent(scene_bounds.radius[object], scene_bounds.radius[object], scene_bounds.radius[object]);
+            occluded[i] = occlusion_buffer.IsOccluded(center - extent, center + extent, mat);
+        }
+    });
+    size_t count = 0;
+    for (size_t i = 0; i < visible.size(); i++)
+        if (!occluded[i]) visible[count++] = visible[i];
+    occlusion_buffer.occluded = visible.size() - count;
+    visible.resize(count);
+}
+
+/*
+    分别用每个阴影级联的正交投影与相机的透视投影剔除物体，最终画面还会剔除被遮挡的物体，
+    只为可见物体生成各渲染过程的绘制命令，所有列表一起写入本帧的间接绘制缓冲区区域。
+*/
+void CullSceneObjects(const Matrix& camera_mat)
+{
+    /* 静态物体位于物体列表的开头，阴影图中的可见物体据此分为静态与动态两部分 */
+    for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
+    {
+        std::vector<uint32_t>& shadow_static = pass_visible[ShadowPass(c, false)];
+        std::vector<uint32_t>& shadow_dynamic = pass_visible[ShadowPass(c, true)];
+        CullBoundingSpheres(scene_bounds, ExtractFrustum(shadow_cascades[c].mat), shadow_dynamic);
+        size_t static_count = std::lower_bound(shadow_dynamic.begin(), shadow_dynamic.end(),
+            (uint32_t)geometry.static_objects.size()) - shadow_dynamic.begin();
+        shadow_static.assign(shadow_dynamic.begin(), shadow_dynamic.begin() + static_count);
+        shadow_dynamic.erase(shadow_dynamic.begin(), shadow_dynamic.begin() + static_count);
+    }
+
+    CullBoundingSpheres(scene_bounds, ExtractFrustum(camera_mat), pass_visible[RENDER_PASS_MAIN]);
+    if (OCCLUSION_CULLING)
+    {
+        RenderOccluders(camera_mat);
+        CullOccludedObjects(camera_mat, pass_visible[RENDER_PASS_MAIN]);
+    }
+    std::vector<uint32_t>& lit = pass_visible[RENDER_PASS_MAIN];
+    size_t lit_count = std::lower_bound(lit.begin(), lit.end(), first_emissive_object) - lit.begin();
+    pass_visible[RENDER_PASS_EMISSIVE].assign(lit.begin() + lit_count, lit.end());
+    lit.resize(lit_count);
+
+    DrawCommandList* lists[RENDER_PASS_COUNT];
+    for (int pass = 0; pass < RENDER_PASS_COUNT; pass++)
+    {
+        DrawCommandList& list = pass_draws[pass];
+        list.Clear();
+        for (size_t i = 0; i < pass_visible[pass].size(); i++)
+        {
+            uint32_t object = pass_visible[pass][i];
+            list.commands.push_back(scene_draws.commands[object]);
+            list.draw_data.push_back(scene_draws.draw_data[object]);
+        }
+        lists[pass] = &list;
+    }
+    UploadDrawCommandLists(lists, RENDER_PASS_COUNT);
+}
+
+/* 生成并焊接静态批次，保存在 geometry 中，由 InitAssets 调用一次 */
+void InitStaticGeometry()
+{
+    ResetScene();
+    geometry.static_objects.clear();
+    LoadRoom();
+    FinalizeStaticBatch(0, 0);
+    geometry.static_vertices.assign(vertex_buffer.data, vertex_buffer.data + vertex_buffer.count);
+    geometry.static_indices.assign(index_buffer.data, index_buffer.data + index_buffer.count);
+    ResetScene();
+
+    /* 以顶点包围盒的中心为球心，到最远顶点的距离为半径 */
+    for (size_t i = 0; i < geometry.static_objects.size(); i++)
+    {
+        StaticObject& object = geometry.static_objects[i];
+        Vec3f lower(INFINITY, INFINITY, INFINITY), upper(-INFINITY, -INFINITY, -INFINITY);
+        for (uint32_t t = 0; t < object.triangle_count; t++)
+        {
+            const TriInd& triangle = geometry.static_indices[object.first_index + t];
+            uint32_t vertices[3] = { triangle.i0, triangle.i1, triangle.i2 };
+            for (int k = 0; k < 3; k++)
+            {
+                const Vec3f& p = geometry.static_vertices[vertices[k]].pos;
+                lower = Vec3f(std::min(lower.x, p.x), std::min(lower.y, p.y), std::min(lower.z, p.z));
+                upper = Vec3f(std::max(upper.x, p.x), std::max(upper.y, p.y), std::max(upper.z, p.z));
+            }
+        }
+        object.center = (lower + upper) * 0.5f;
+        Vec3f half_extent = upper - object.center;
+        object.radius = length(half_extent);
+    }
+}
+
+/*
+    生成本帧的动态几何。持久映射时数据直接写入流式缓冲区当前的映射区域，
+    否则写入 CPU 端的缓冲区后只上传脏区间。区域容量不足时扩大缓冲区并重新生成本帧数据。
+*/
+void LoadScene()
+{
+    geometry.frame++;
+    for (;;)
+    {
+        ResetScene();
+        scene_objects.clear();
+        geometry.vertex_dirty.clear();
+        geometry.index_dirty.clear();
+
+        uint8_t* vertex_region = vertex_stream.BeginRegion();
+        uint8_t* index_region = index_stream.BeginRegion();
+        if (vertex_region) vertex_buffer.Attach((Vertex*)vertex_region, vertex_stream.region_size / sizeof(Vertex));
+        if (index_region) index_buffer.Attach((TriInd*)index_region, index_stream.region_size / sizeof(TriInd));
+
+        for (int i = 0; i < 64; i++)
+            LoadSphere(i, balls_pos[i], ball_radius, balls_color[i], BallEmitsLight(i));
+        ReserveSceneObjects();
+        ExpandSceneObjects();
+
+        if (!vertex_buffer.overflowed && !index_buffer.overflowed &&
+            sizeof(Vertex) * vertex_buffer.count <= vertex_stream.region_size &&
+            sizeof(TriInd) * index_buffer.count <= index_stream.region_size) break;
+        GrowStreamBuffer(vertex_stream, sizeof(Vertex), vertex_buffer.high_water, "Vertex stream buffer");
+        GrowStreamBuffer(index_stream, sizeof(TriInd), index_buffer.high_water, "Index stream buffer");
+        InvalidateDynamicGeometry();
+    }
+
+    geometry.uploaded_bytes =
+        UploadDirtyRanges(vertex_stream, geometry.vertex_dirty, vertex_buffer.data) +
+        UploadDirtyRanges(index_stream, geometry.index_dirty, index_buffer.data);
+
+    BuildDrawCommands();
+}
+
+/* 所有级联中被剔除的物体数之和 */
+size_t ShadowCulledCount()
+{
+    size_t culled = (size_t)scene_bounds.count * SHADOW_CASCADE_COUNT;
+    for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
+        culled -= pass_visible[ShadowPass(c, false)].size() + pass_visible[ShadowPass(c, true)].size();
+    return culled;
+}
+
+/* 以指定的顶点格式绘制某个渲染过程的可见物体，每个渲染过程只调用一次 glMultiDrawElementsIndirect */
+void DrawSceneGeometry(VertexLayout layout, int pass)
+{
+    gl_state.BindVertexArray(vertex_array_cache.Get(layout));
+    gl_state.BindDrawIndirectBuffer(indirect_stream.buffer_object);
+    SubmitDrawCommandList(pass_draws[pass]);
+}
+
+/* 把视口与深度着色器的变换矩阵设置为某个级联 */
+void BeginShadowCascade(int cascade)
+{
+    glViewport(shadow_cascades[cascade].offset_x, 0, shadow_cascades[cascade].size, shadow_cascades[cascade].size);
+    glProgramUniformMatrix4fv(depth_shader_program_object, depth_mat_trans_location, 1, false, (float*)&shadow_cascades[cascade].mat);
+}
+
+/*
+    渲染阴影图集中的所有级联。使用阴影缓存时只在 refresh_static 为真时重新渲染静态层，
+    每帧把静态层复制到阴影图后再绘制动态投影物。
+*/
+void RenderShadowMap(bool refresh_static)
+{
+    shadow_timer.Begin(refresh_static ? SHADOW_PASS_FULL : SHADOW_PASS_CACHED);
+    gl_state.UseProgram(depth_shader_program_object);
+    if (SHADOW_CACHE && !refresh_static)
+    {
+        glCopyImageSubData(shadow_cache.texture, GL_TEXTURE_2D, 0, 0, 0, 0,
+            depth_map_object, GL_TEXTURE_2D, 0, 0, 0, 0, shadow_atlas_width, shadow_atlas_height, 1);
+    }
+    else
+    {
+        gl_state.BindFramebuffer(SHADOW_CACHE ? shadow_cache.framebuffer : depth_map_framebuffer_object);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
+        {
+            BeginShadowCascade(c);
+            DrawSceneGeometry(VERTEX_LAYOUT_POSITION, ShadowPass(c, false));
+        }
+        if (SHADOW_CACHE)
+            glCopyImageSubData(shadow_cache.texture, GL_TEXTURE_2D, 0, 0, 0, 0,
+                depth_map_object, GL_TEXTURE_2D, 0, 0, 0, 0, shadow_atlas_width, shadow_atlas_height, 1);
+    }
+    gl_state.BindFramebuffer(depth_map_framebuffer_object);
+    for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
+    {
+        BeginShadowCascade(c);
+        DrawSceneGeometry(VERTEX_LAYOUT_POSITION, ShadowPass(c, true));
+    }
+    shadow_timer.End();
+}
+
+/* 按键从松开变为按下时返回 true */
+bool KeyPressed(GLFWwindow* window, int key)
+{
+    static bool key_down[GLFW_KEY_LAST + 1];
+    bool down = glfwGetKey(window, key) == GLFW_PRESS;
+    bool pressed = down && !key_down[key];
+    key_down[key] = down;
+    return pressed;
 }
 
 void Print(Matrix mat)
@@ -481,6 +3525,8 @@ void Print(Matrix mat)
 int main(void)
 {
     GLFWwindow* window;
+    startup_time = std::chrono::steady_clock::now();
+    bool first_frame = true;
 
     /* 初始化 GLFW 库 */
     if (!glfwInit())
@@ -514,21 +3560,21 @@ int main(void)
 
     InitAssets();
 
-    int32_t 
-    mat_proj_location, 
-    mat_trans_location, 
-    v_light_direct_location, 
-    depth_mat_trans_location, 
-    mat_depth_location,
-    lights_pos_location,
-    lights_brightness_location;
-    mat_proj_location = glGetUniformLocation(shader_program_object, "mat_proj");
-    mat_trans_location = glGetUniformLocation(shader_program_object, "mat_trans");
-    v_light_direct_location = glGetUniformLocation(shader_program_object, "v_light_direct");
-    depth_mat_trans_location = glGetUniformLocation(depth_shader_program_object, "mat_trans");
-    mat_depth_location = glGetUniformLocation(shader_program_object, "mat_depth");
-    lights_pos_location = glGetUniformLocation(shader_program_object, "lights_pos");
-    lights_brightness_location = glGetUniformLocation(shader_program_object, "lights_brightness");
+    /* 不随帧改变的常量 */
+    frame_constants.cluster_grid[0] = CLUSTER_X;
+    frame_constants.cluster_grid[1] = CLUSTER_Y;
+    frame_constants.cluster_grid[2] = CLUSTER_Z;
+    frame_constants.cluster_grid[3] = 0;
+    frame_constants.cluster_depth_params[0] = CLUSTER_Z / logf(CLUSTER_FAR / CLUSTER_NEAR);
+    frame_constants.cluster_depth_params[1] = CLUSTER_Z * logf(CLUSTER_NEAR) / logf(CLUSTER_FAR / CLUSTER_NEAR);
+    frame_constants.evsm_exponents[0] = EVSM_POSITIVE_EXPONENT;
+    frame_constants.evsm_exponents[1] = EVSM_NEGATIVE_EXPONENT;
+    frame_constants.cascade_count = SHADOW_CASCADE_COUNT;
+    frame_constants.shadow_filter_radius = SHADOW_FILTER_RADIUS;
+    frame_constants.shadow_min_variance = SHADOW_MIN_VARIANCE;
+    frame_constants.Kq = Kq;
+    frame_constants.Kp = Kp;
+    frame_constants.Kc = Kc;
 
     glfwSwapInterval(1);
 
@@ -537,20 +3583,22 @@ int main(void)
 
     InitBalls();
 
+    /* 启动用于生成场景的工作线程 */
+    if (std::thread::hardware_concurrency() > 1)
+        thread_pool.Start(std::thread::hardware_concurrency() - 1);
+
     double camera_pitch = 0.19*pi, camera_yaw = 0.225*pi;
     double last_x = 0.0, last_y = 0.0;
     int last_click = 0;
 
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
+    gl_state.Invalidate();
 
     std::chrono::steady_clock::time_point tp = std::chrono::steady_clock::now();
 
     Vec3f v_light_direct = Vec3f(-3.0, -1.0, 2.0);
 
-    Vec3f lights_pos[8];
-    Vec3f lights_brightness[8];
-
     for (int i = 0; i < 1000; i++)
         UpdateBalls(0.002);
 
@@ -559,98 +3607,251 @@ int main(void)
     {
         /* 帧绘制用时统计 */
         std::chrono::steady_clock::time_point this_tp = std::chrono::steady_clock::now();
-        std::cout << "Last frame time used: " << (this_tp - tp) / std::chrono::milliseconds(1) << "ms\n";
+        std::cout << "Last frame time used: " << (this_tp - tp) / std::chrono::milliseconds(1) << "ms"
+            << ", stream fence waits: " << vertex_stream.fence_waits + index_stream.fence_waits
+            << ", stream stall: " << vertex_stream.stall_ms + index_stream.stall_ms << "ms"
+            << ", uploaded: " << geometry.uploaded_bytes / 1024.0 << "KB"
+            << ", GL binds issued: " << gl_state.issued << ", elided: " << gl_state.elided
+            << ", culled shadow: " << ShadowCulledCount() << "/" << scene_bounds.count * SHADOW_CASCADE_COUNT
+            << ", culled main: " << scene_bounds.count - pass_visible[RENDER_PASS_MAIN].size() - pass_visible[RENDER_PASS_EMISSIVE].size() << "/" << scene_bounds.count
+            << " (occluded: " << occlusion_buffer.occluded << ")"
+            << ", shadow pass full: " << shadow_timer.elapsed_ms[SHADOW_PASS_FULL] << "ms"
+            << ", cached: " << shadow_timer.elapsed_ms[SHADOW_PASS_CACHED] << "ms"
+            << " (saved: " << (SHADOW_CACHE ? std::max(0.0, shadow_timer.elapsed_ms[SHADOW_PASS_FULL] - shadow_timer.elapsed_ms[SHADOW_PASS_CACHED]) : 0.0) << "ms)"
+            << ", shadow tier: " << shadow_governor.tier
+            << ", shadow filter: " << SHADOW_FILTER_MODE_NAMES[shadow_filter.mode] << " " << ShadowFilterTaps(shadow_filter) << " taps"
+            << ", point lights: " << light_grid.lights.size() << " (" << light_grid.indices.size() << " cluster refs, "
+            << light_grid.build_ms << "ms)"
+            << ", shader variants: " << shader_variants.ready << "/" << shader_variants.programs.size()
+            << ", " << RENDER_PATH_NAMES[render_path];
+        if (render_path == RENDER_PATH_DEFERRED)
+            std::cout << " geometry pass: " << gbuffer_timer.elapsed_ms[0] << "ms, lighting pass: ";
+        else
+            std::cout << " depth pre-pass: " << DEPTH_PREPASS_MODE_NAMES[depth_prepass.mode]
+                << (depth_prepass.mode == DEPTH_PREPASS_AUTO ? (depth_prepass.enabled ? " (on) " : " (off) ") : " ")
+                << prepass_timer.elapsed_ms[0] << "ms, overdraw: " << depth_prepass.overdraw
+                << ", shaded fragments per pixel: " << depth_prepass.shaded_per_pixel << ", main pass: ";
+        std::cout << main_pass_timer.elapsed_ms[SHADOW_BENCHMARK_CONFIG_COUNT] << "ms";
+        if (ShadowFilterUsesMoments(shadow_filter.mode))
+            std::cout << ", moments: " << moments_timer.elapsed_ms[0] << "ms, bleed reduction: " << shadow_bleed_reduction;
+        std::cout << "\n";
+        gl_state.issued = gl_state.elided = 0;
         tp = this_tp;
 
         /* 更新光源方向 */
-        v_light_direct = RotationMatrix(0.0, 0.003, 0.0) * v_light_direct;
-        Matrix depth_map_mat_trans = Matrix(
-            0.12, 0.0, 0.0, 0.0,
-            0.0, 0.12, 0.0, 0.0,
-            0.0, 0.0, 1.0 / 25.0, 0.0,
-            0.0, 0.0, -1.0, 1.0
-        ) * fake_inverse(LookAtMatrix(v_light_direct * -10.0, Vec3f(0.0, 0.0, 0.0)));
-        glProgramUniformMatrix4fv(depth_shader_program_object, depth_mat_trans_location, 1, false, (float*)&depth_map_mat_trans);
-        glProgramUniformMatrix4fv(shader_program_object, mat_depth_location, 1, false, (float*)&depth_map_mat_trans);
-        glProgramUniform3fv(shader_program_object, v_light_direct_location, 1, (float*)&v_light_direct);
-
-        /* 加载场景 */
-        LoadScene();
-        for (int i = 0; i < 8; i++)
+        if (!shadow_benchmark.running)
+            v_light_direct = RotationMatrix(0.0, 0.003, 0.0) * v_light_direct;
+
+        int32_t width, height;
+        glfwGetWindowSize(window, &width, &height);
+        Matrix mat_proj, mat_trans;
+        Matrix camera_to_world = TranslateMatrix(CameraTranslation.x, CameraTranslation.y, CameraTranslation.z) * CameraRotation;
+        mat_proj = ProjectionMatrix(1.0f, 100.0f, (float)width / (float)height, pi / 3.0);
+        mat_trans = fake_inverse(camera_to_world);
+
+        /* 阴影级联跟随相机，使用阴影缓存记录的光源方向 */
+        bool refresh_static_shadow = shadow_cache.Update(v_light_direct);
+        FitShadowCascades(shadow_cache.light_direction, camera_to_world, 1.0f, (float)width / (float)height, pi / 3.0);
+        refresh_static_shadow = shadow_cache.CascadesChanged() || refresh_static_shadow;
+
+        /* 本帧的常量，所有程序共享，每帧只上传一次 */
+        FrameConstants& frame = frame_constants;
+        frame.mat_proj = mat_proj;
+        frame.mat_trans = mat_trans;
+        frame.mat_view_inverse = camera_to_world;
+        for (int c = 0; c < SHADOW_CASCADE_COUNT; c++)
         {
-            int ball_index = ((i << 3) | i);
-            lights_pos[i] = balls_pos[ball_index];
-            lights_brightness[i] = balls_color[ball_index];
+            frame.mat_depth[c] = shadow_cascades[c].mat;
+            frame.cascade_far[c] = shadow_cascades[c].far_distance;
+            /* 深度差(0 到 1)对应的半影宽度，以级联像素为单位 */
+            frame.cascade_penumbra[c] = shadow_cascades[c].depth_range * tan(SHADOW_LIGHT_ANGLE) / shadow_cascades[c].texel_size;
+            frame.cascade_rect[c][0] = (float)shadow_cascades[c].offset_x / shadow_atlas_width;
+            frame.cascade_rect[c][1] = 0.0f;
+            frame.cascade_rect[c][2] = (float)shadow_cascades[c].size / shadow_atlas_width;
+            frame.cascade_rect[c][3] = (float)shadow_cascades[c].size / shadow_atlas_height;
         }
+        /* 平行光方向在 CPU 上变换到观察空间 */
+        Vec3f view_light_direction = normalize(mat_trans * v_light_direct);
+        frame.light_direction[0] = view_light_direction.x;
+        frame.light_direction[1] = view_light_direction.y;
+        frame.light_direction[2] = view_light_direction.z;
+        frame.light_direction[3] = 0.0f;
+        frame.proj_params[0] = mat_proj.m[0][0];
+        frame.proj_params[1] = mat_proj.m[1][1];
+        frame.proj_params[2] = mat_proj.m[2][2];
+        frame.proj_params[3] = mat_proj.m[3][2];
+        frame.cluster_tile_scale[0] = (float)CLUSTER_X / width;
+        frame.cluster_tile_scale[1] = (float)CLUSTER_Y / height;
+        frame.viewport_size[0] = (float)width;
+        frame.viewport_size[1] = (float)height;
+
+        /* 阴影过滤设置 */
+        shadow_benchmark.Update();
+        frame.shadow_bleed_reduction = shadow_bleed_reduction;
+        UploadFrameConstants();
+
+        /* 加载场景，并按各级联与相机的视锥剔除物体 */
+        LoadScene();
+        CullSceneObjects(mat_proj * mat_trans);
 
-        glProgramUniform3fv(shader_program_object, lights_brightness_location, 8, (float*)lights_brightness);
-        glProgramUniform3fv(shader_program_object, lights_pos_location, 8, (float*)lights_pos);
+        /* 点光源分簇 */
+        GatherBallLights(mat_trans, light_grid.lights);
+        light_grid.Build(mat_proj);
+        light_grid.Upload();
 
 
         /* 渲染阴影图 */
-
-        glBindFramebuffer(GL_FRAMEBUFFER, depth_map_framebuffer_object);
-        glClear(GL_DEPTH_BUFFER_BIT);
-        glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-        glUseProgram(depth_shader_program_object);
-        glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_object);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_object);
-        glVertexAttribPointer(0, 3, GL_FLOAT, false, 40, (void*)0);
-        glEnableVertexAttribArray(0);
-        glDrawElements(GL_TRIANGLES, cnt_index * 3, GL_UNSIGNED_INT, nullptr);
-        glDisableVertexAttribArray(0);
+        RenderShadowMap(refresh_static_shadow);
+        if (ShadowFilterUsesMoments(shadow_filter.mode))
+            shadow_moments.Generate(shadow_filter.mode, frame.cascade_rect);
 
 
         /* 渲染最终画面 */
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
         glClearColor(0.0, 0.0, 0.0, 1.0);
+        /* 变体尚未编译完成时 lighting_program 为 0，用简化程序走前向路径；测量时等待变体完成 */
+        shader_variants.Poll();
+        uint32_t lighting_program = shader_variants.Get(render_path, LightingFeatures(), shadow_benchmark.running);
+        bool deferred = render_path == RENDER_PATH_DEFERRED && lighting_program != 0;
+        if (deferred)
+        {
+            /* 几何阶段：写入 G-buffer */
+            gbuffer.Resize(std::max(width, 1), std::max(height, 1));
+            gl_state.BindFramebuffer(gbuffer.framebuffer);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            gl_state.UseProgram(gbuffer_program_object);
+            gbuffer_timer.Begin(0);
+            DrawSceneGeometry(VERTEX_LAYOUT_FULL, RENDER_PASS_MAIN);
+            gl_state.UseProgram(emissive_program_object);
+            DrawSceneGeometry(VERTEX_LAYOUT_POSITION, RENDER_PASS_EMISSIVE);
+            gbuffer_timer.End();
+        }
+
+        gl_state.BindFramebuffer(0);
         glClear(GL_COLOR_BUFFER_BIT);
         glClear(GL_DEPTH_BUFFER_BIT);
+        gl_state.BindTextureUnit(0, depth_map_object);
+        gl_state.BindTextureUnit(1, depth_map_object);
+        if (shadow_moments.created) gl_state.BindTextureUnit(2, shadow_moments.textures[0]);
+        if (deferred)
+        {
+            /* 光照阶段：每个像素计算一次光照 */
+            gl_state.UseProgram(lighting_program);
+            gl_state.BindVertexArray(vertex_array_cache.Get(VERTEX_LAYOUT_POSITION));
+            gl_state.BindTextureUnit(4, gbuffer.albedo);
+            gl_state.BindTextureUnit(5, gbuffer.normal);
+            gl_state.BindTextureUnit(6, gbuffer.depth);
+            glDisable(GL_DEPTH_TEST);
+            main_pass_timer.Begin(MainPassTimerTag(), shadow_benchmark.running);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            main_pass_timer.End();
+            glEnable(GL_DEPTH_TEST);
+        }
+        else
+        {
+            /* 自发光物体先绘制，写入的深度也能挡住之后的受光照片段 */
+            gl_state.UseProgram(emissive_program_object);
+            DrawSceneGeometry(VERTEX_LAYOUT_POSITION, RENDER_PASS_EMISSIVE);
+            bool prepass = depth_prepass.Active();
+            if (prepass)
+            {
+                gl_state.UseProgram(prepass_program_object);
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                prepass_timer.Begin(0);
+                DrawSceneGeometry(VERTEX_LAYOUT_POSITION, RENDER_PASS_MAIN);
+                prepass_timer.End();
+                glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                glDepthFunc(GL_EQUAL);
+                glDepthMask(GL_FALSE);
+            }
+            gl_state.UseProgram(lighting_program ? lighting_program : fallback_program_object);
+            main_pass_timer.Begin(MainPassTimerTag(), shadow_benchmark.running);
+            depth_prepass.Begin(width, height, prepass);
+            DrawSceneGeometry(VERTEX_LAYOUT_FULL, RENDER_PASS_MAIN);
+            depth_prepass.End();
+            main_pass_timer.End();
+            if (prepass)
+            {
+                glDepthFunc(GL_LESS);
+                glDepthMask(GL_TRUE);
+            }
+        }
 
-        int32_t width, height;
-        glfwGetWindowSize(window, &width, &height);
-        glViewport(0, 0, width, height);
-        glUseProgram(shader_program_object);
-        glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_object);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_object);
-        glVertexAttribPointer(0, 3, GL_FLOAT, false, 40, (void*)0);
-        glVertexAttribPointer(1, 3, GL_FLOAT, false, 40, (void*)12);
-        glVertexAttribPointer(2, 3, GL_FLOAT, false, 40, (void*)24);
-        glVertexAttribPointer(3, 1, GL_FLOAT, false, 40, (void*)36);
-        glEnableVertexAttribArray(0);
-        glEnableVertexAttribArray(1);
-        glEnableVertexAttribArray(2);
-        glEnableVertexAttribArray(3);
-
-        Matrix mat_proj, mat_trans;
-        mat_proj = ProjectionMatrix(1.0f, 100.0f, (float)width / (float)height, pi / 3.0);
-        mat_trans = fake_inverse(
-            TranslateMatrix(CameraTranslation.x, CameraTranslation.y, CameraTranslation.z) * CameraRotation
-        );
-        glUniformMatrix4fv(mat_proj_location, 1, 0, (float*)&mat_proj);
-        glUniformMatrix4fv(mat_trans_location, 1, 0, (float*)&mat_trans);
-
-        glBindTexture(GL_TEXTURE_2D, depth_map_object);
-        glDrawElements(GL_TRIANGLES, cnt_index * 3, GL_UNSIGNED_INT, nullptr);
-
-        glDisableVertexAttribArray(0);
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(2);
-        glDisableVertexAttribArray(3);
+        vertex_stream.EndRegion();
+        index_stream.EndRegion();
+        indirect_stream.EndRegion();
+        draw_data_stream.EndRegion();
+        light_stream.EndRegion();
+        frame_constant_stream.EndRegion();
 
         /* 交换缓冲 */
+        /* 质量调节器使用本帧 CPU 用时(不含等待垂直同步)与最近测得的 GPU 用时中较大者 */
+        if (SHADOW_GOVERNOR && !shadow_benchmark.running)
+        {
+            double cpu_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - this_tp).count();
+            double gpu_ms = shadow_timer.elapsed_ms[refresh_static_shadow ? SHADOW_PASS_FULL : SHADOW_PASS_CACHED] +
+                main_pass_timer.elapsed_ms[SHADOW_BENCHMARK_CONFIG_COUNT] +
+                (deferred ? gbuffer_timer.elapsed_ms[0] : prepass_timer.elapsed_ms[0]) +
+                (ShadowFilterUsesMoments(shadow_filter.mode) ? moments_timer.elapsed_ms[0] : 0.0);
+            if (shadow_governor.Update(std::max(cpu_ms, gpu_ms))) shadow_governor.Apply();
+        }
+
         glfwSwapBuffers(window);
+        if (first_frame)
+        {
+            first_frame = false;
+            std::cout << "Time to first frame: "
+                << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startup_time).count()
+                << "ms (" << (lighting_program ? "full" : "fallback") << " shading, "
+                << (ASYNC_SHADER_COMPILATION ? (parallel_shader_compile ? "parallel" : "async") : "blocking") << " shader compilation)" << std::endl;
+        }
 
         /* 处理窗口消息 */
         glfwPollEvents();
 
 
-        /* 更新帧资源 */
+        /* 更新帧资源，基准测试期间场景保持不变 */
+        if (shadow_benchmark.running) continue;
         for (int i = 0; i < 10; i++)
             UpdateBalls(0.002);
 
 
-        /* 处理输入 */
+        /*
+            处理输入：1 到 5 切换阴影过滤方式，[ 与 ] 调整采样数，, 与 . 调整矩阴影图的光渗透抑制，
+            B 开始阴影过滤基准测试
+        */
+        for (int mode = 0; mode < SHADOW_FILTER_MODE_COUNT; mode++)
+            if (KeyPressed(window, GLFW_KEY_1 + mode)) shadow_filter.mode = mode;
+        if (KeyPressed(window, GLFW_KEY_LEFT_BRACKET)) shadow_filter.taps = std::max(4, shadow_filter.taps / 2);
+        if (KeyPressed(window, GLFW_KEY_RIGHT_BRACKET)) shadow_filter.taps = std::min(MAX_SHADOW_FILTER_TAPS, shadow_filter.taps * 2);
+        if (KeyPressed(window, GLFW_KEY_COMMA)) shadow_bleed_reduction = std::max(0.0f, shadow_bleed_reduction - 0.05f);
+        if (KeyPressed(window, GLFW_KEY_PERIOD)) shadow_bleed_reduction = std::min(0.95f, shadow_bleed_reduction + 0.05f);
+        if (KeyPressed(window, GLFW_KEY_L)) all_balls_emit_light = !all_balls_emit_light;
+        if (KeyPressed(window, GLFW_KEY_M)) disney_diffuse = !disney_diffuse;
+        if (KeyPressed(window, GLFW_KEY_O)) depth_prepass.mode = (depth_prepass.mode + 1) % DEPTH_PREPASS_MODE_COUNT;
+        if (KeyPressed(window, GLFW_KEY_P))
+        {
+            render_path = (render_path + 1) % RENDER_PATH_COUNT;
+            std::cout << "Render path: " << RENDER_PATH_NAMES[render_path] << std::endl;
+        }
+        if (KeyPressed(window, GLFW_KEY_B))
+        {
+            /* 基准测试场景：初始的相机位置与光源方向 */
+            CameraTranslation = Vec3f(9.0, 9.0f, -11.0f);
+            camera_pitch = 0.19*pi;
+            camera_yaw = 0.225*pi;
+            CameraRotation = RotationMatrix(camera_pitch, camera_yaw, 0.0);
+            v_light_direct = Vec3f(-3.0, -1.0, 2.0);
+            /* 基准测试在最高质量等级下进行 */
+            if (shadow_governor.tier != 0)
+            {
+                shadow_governor = ShadowGovernor();
+                shadow_governor.Apply();
+            }
+            shadow_benchmark.Start();
+            continue;
+        }
+
         const float move_speed = 0.05;
         if (glfwGetKey(window, GLFW_KEY_W)) CameraTranslation = CameraTranslation + Vec3f(CameraRotation.m[2][0], CameraRotation.m[2][1], CameraRotation.m[2][2]) * move_speed;
         if (glfwGetKey(window, GLFW_KEY_S)) CameraTranslation = CameraTranslation - Vec3f(CameraRotation.m[2][0], CameraRotation.m[2][1], CameraRotation.m[2][2]) * move_speed;
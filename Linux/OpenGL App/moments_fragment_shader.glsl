@@ -0,0 +1,70 @@
+#version 450 core
+
+const int MAX_SHADOW_CASCADES = 4;
+
+in vec2 texcoord;
+
+out vec4 moments;
+
+layout (binding = 1) uniform sampler2D depth_map;
+layout (binding = 3) uniform sampler2D blur_map;
+
+/*
+    0: 读取深度计算矩并做水平模糊，1: 对水平模糊的结果做竖直模糊，
+    2: 由上一级 mipmap 生成当前级中一个级联的区域，此时 blur_map 为只能访问上一级的矩纹理
+*/
+uniform int blur_pass;
+/* 0: VSM，1: EVSM */
+uniform int moments_mode;
+uniform int blur_radius;
+uniform vec2 evsm_exponents;
+uniform vec4 cascade_rect[MAX_SHADOW_CASCADES];
+uniform int cascade_count;
+/* blur_pass 为 2 时上一级中当前级联的区域(起点与大小，以像素为单位) */
+uniform ivec4 source_rect;
+
+vec4 ComputeMoments(float depth)
+{
+    if (moments_mode == 0) return vec4(depth, depth * depth, 0.0, 0.0);
+    float w = depth * 2.0 - 1.0;
+    float p = exp(evsm_exponents.x * w);
+    float n = -exp(-evsm_exponents.y * w);
+    return vec4(p, p * p, n, n * n);
+}
+
+void main()
+{
+    if (blur_pass == 2)
+    {
+        ivec2 p = ivec2(gl_FragCoord.xy) * 2;
+        ivec2 p_min = source_rect.xy, p_max = source_rect.xy + source_rect.zw - 1;
+        moments = 0.25 * (
+            texelFetch(blur_map, clamp(p, p_min, p_max), 0) +
+            texelFetch(blur_map, clamp(p + ivec2(1, 0), p_min, p_max), 0) +
+            texelFetch(blur_map, clamp(p + ivec2(0, 1), p_min, p_max), 0) +
+            texelFetch(blur_map, clamp(p + ivec2(1, 1), p_min, p_max), 0));
+        return;
+    }
+
+    /* 模糊只在当前像素所属的级联内进行 */
+    int cascade = 0;
+    while (cascade + 1 < cascade_count && texcoord.x >= cascade_rect[cascade + 1].x) cascade++;
+    vec4 rect = cascade_rect[cascade];
+    vec2 texel = 1.0 / vec2(textureSize(depth_map, 0));
+    vec2 uv_min = rect.xy + texel * 0.5, uv_max = rect.xy + rect.zw - texel * 0.5;
+    vec2 direction = (blur_pass == 0) ? vec2(texel.x, 0.0) : vec2(0.0, texel.y);
+
+    /* 高斯核的标准差取半径的一半 */
+    float sigma = max(float(blur_radius) * 0.5, 0.5);
+    vec4 sum = vec4(0.0);
+    float weight_sum = 0.0;
+    for (int i = -blur_radius; i <= blur_radius; i++)
+    {
+        float weight = exp(-float(i * i) / (2.0 * sigma * sigma));
+        vec2 uv = clamp(texcoord + direction * float(i), uv_min, uv_max);
+        vec4 m = (blur_pass == 0) ? ComputeMoments(texture(depth_map, uv).r) : texture(blur_map, uv);
+        sum += m * weight;
+        weight_sum += weight;
+    }
+    moments = sum / weight_sum;
+}
@@ -0,0 +1,11 @@
+#version 450 core
+
+out vec2 texcoord;
+
+/* 由 gl_VertexID 生成覆盖整个视口的三角形，不读取顶点属性 */
+void main()
+{
+    vec2 coord = vec2((gl_VertexID == 1) ? 3.0 : -1.0, (gl_VertexID == 2) ? 3.0 : -1.0);
+    texcoord = (coord + 1.0) * 0.5;
+    gl_Position = vec4(coord, 0.0, 1.0);
+}
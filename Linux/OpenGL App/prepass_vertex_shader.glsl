@@ -0,0 +1,13 @@
+#version 450 core
+
+layout (location = 0) in vec3 vs_pos;
+
+#include "frame_constants.glsl"
+
+/* 与 vertex_shader.glsl 用同样的方式计算位置，着色阶段才能用 GL_EQUAL 比较深度 */
+invariant gl_Position;
+
+void main()
+{
+    gl_Position = mat_proj*(mat_trans*vec4(vs_pos, 1.0));
+}
@@ -0,0 +1,117 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+/*
+    固定数量工作线程的线程池。ParallelFor 把 [0, count) 按 grain 划分为若干块，
+    由工作线程与调用线程共同执行，全部完成后返回。
+
+    每次 ParallelFor 对应一个 generation。工作线程只能在持锁时加入仍处于 open 状态的
+    generation；ParallelFor 等到所有加入的工作线程都离开后才关闭它并返回。关闭后迟到的
+    工作线程不会再进入 RunTasks，因此下一次调用改写 task/task_count 时没有线程在读取它们。
+    多个调用线程之间由 caller_mutex 串行化。
+*/
+struct ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::mutex caller_mutex;
+    std::mutex mutex;
+    std::condition_variable work_cv, done_cv;
+    std::function<void(uint32_t)> task;
+    uint32_t task_count;
+    std::atomic<uint32_t> next_task;
+    uint32_t finished_tasks;
+    uint32_t active_workers;
+    uint64_t generation;
+    bool open;
+    bool quit;
+
+    ThreadPool() { task_count = finished_tasks = active_workers = 0; next_task = 0; generation = 0; open = false; quit = false; }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        work_cv.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    }
+
+    void Start(uint32_t thread_count)
+    {
+        for (uint32_t i = 0; i < thread_count; i++)
+            workers.push_back(std::thread([this]() { WorkerLoop(); }));
+    }
+
+    void WorkerLoop()
+    {
+        uint64_t seen_generation = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_cv.wait(lock, [&]() { return quit || (open && generation != seen_generation); });
+                if (quit) return;
+                seen_generation = generation;
+                active_workers++;
+            }
+            RunTasks();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active_workers--;
+            }
+            done_cv.notify_all();
+        }
+    }
+
+    void RunTasks()
+    {
+        uint32_t done = 0;
+        for (uint32_t i = next_task.fetch_add(1); i < task_count; i = next_task.fetch_add(1))
+        {
+            task(i);
+            done++;
+        }
+        if (done)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished_tasks += done;
+        }
+    }
+
+    void ParallelFor(uint32_t count, uint32_t grain, const std::function<void(uint32_t, uint32_t)>& body)
+    {
+        uint32_t chunks = (count + grain - 1) / grain;
+        if (workers.empty() || chunks <= 1)
+        {
+            if (count) body(0, count);
+            return;
+        }
+        std::lock_guard<std::mutex> caller_lock(caller_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = [&](uint32_t chunk) { body(chunk * grain, std::min(count, (chunk + 1) * grain)); };
+            task_count = chunks;
+            finished_tasks = 0;
+            next_task = 0;
+            generation++;
+            open = true;
+        }
+        work_cv.notify_all();
+        RunTasks();
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&]() { return finished_tasks == task_count && active_workers == 0; });
+        open = false;
+        task = nullptr;
+    }
+};
+
+#endif
@@ -1,24 +1,37 @@
-#version 450 core
+#version 460 core
 
 layout (location = 0) in vec3 vs_pos;
 layout (location = 1) in vec3 vs_norm;
-layout (location = 2) in vec3 vs_color;
-layout (location = 3) in float vs_flag;
+
+struct DrawData
+{
+    vec4 color;
+};
+
+layout (std430, binding = 0) readonly buffer DrawDataBuffer
+{
+    DrawData draw_data[];
+};
 
 out vec4 fs_norm;
 out vec4 fs_pos;
 out vec3 fs_color;
-out float fs_flag;
+/* 观察空间中的位置与法线，片段着色器不再逐像素做变换 */
+out vec4 fs_view_pos;
+out vec4 fs_view_norm;
+
+#include "frame_constants.glsl"
 
-uniform mat4 mat_proj;
-uniform mat4 mat_trans;
+/* 深度预渲染(prepass_vertex_shader.glsl)写入的深度必须与这里完全一致 */
+invariant gl_Position;
 
 void main()
 {
-    fs_flag = vs_flag;
-    fs_color = vs_color;
+    fs_color = draw_data[gl_DrawID].color.rgb;
     vec4 norm = vec4(vs_norm , 0.0);
     fs_norm = norm;
     fs_pos = vec4(vs_pos, 1.0);
-    gl_Position = mat_proj*mat_trans*fs_pos;
+    fs_view_pos = mat_trans*fs_pos;
+    fs_view_norm = mat_trans*norm;
+    gl_Position = mat_proj*(mat_trans*fs_pos);
 }
\ No newline at end of file